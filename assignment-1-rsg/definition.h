@@ -88,6 +88,17 @@ class Definition {
    */
   
   const Production& getRandomProduction() const;
+
+  /**
+   * Iterators: begin, end
+   * ---------------------
+   * Provide read-only access to all of the Definition's
+   * expansions, in the order they appear in the grammar file.
+   */
+
+  typedef vector<Production>::const_iterator const_iterator;
+  const_iterator begin() const { return possibleExpansions.begin(); }
+  const_iterator end() const { return possibleExpansions.end(); }
   
  private:
   string nonterminal;
@@ -0,0 +1,37 @@
+/**
+ * File: expander.cc
+ * -----------------
+ * Provides the implementation of the Expander class.
+ */
+
+#include "expander.h"
+
+/**
+ * Method: expand
+ * --------------
+ * Works through the open productions depth first, which is the
+ * order the recursive version visited them in: the top of the stack
+ * is the production being expanded, and a nonterminal token pushes
+ * a production of its own.  The stack keeps its capacity from one
+ * call to the next.
+ */
+
+void Expander::expand(int nonterminal, string& sentence)
+{
+  int production = grammar.getRandomProduction(nonterminal, random);
+  stack.push_back(make_pair(grammar.productionBegin(production), grammar.productionEnd(production)));
+  while (!stack.empty()) {
+    pair<const int *, const int *>& top = stack.back();
+    if (top.first == top.second) {
+      stack.pop_back();
+      continue;
+    }
+    int token = *top.first++;
+    if (Grammar::isNonterminal(token)) {
+      production = grammar.getRandomProduction(Grammar::nonterminalOf(token), random);
+      stack.push_back(make_pair(grammar.productionBegin(production), grammar.productionEnd(production)));
+    } else {
+      sentence += grammar.getTerminal(token);
+    }
+  }
+}
@@ -0,0 +1,62 @@
+/**
+ * File: expander.h
+ * ----------------
+ * Defines the abstraction for the Expander class, which turns
+ * nonterminals of a compiled Grammar into random sentences.
+ * Expansion keeps its own stack instead of recursing, so deep
+ * or recursive grammars can't overflow the call stack, and it
+ * appends to a string the client hands in, so that one buffer
+ * can be reused for sentence after sentence.
+ */
+
+#ifndef __expander__
+#define __expander__
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "grammar.h"
+using namespace std;
+
+class Expander {
+
+ public:
+
+  /**
+   * Constructor: Expander
+   * ---------------------
+   * Constructs an Expander over the specified grammar, which
+   * must outlive it.  Each Expander makes its choices with a
+   * RandomGenerator of its own, seeded from the current time.
+   */
+
+  Expander(const Grammar& grammar) : grammar(grammar) {}
+
+  /**
+   * Method: setSeed
+   * ---------------
+   * Restarts the Expander's RandomGenerator with the given seed, so
+   * that the expansions from here on are reproducible.
+   */
+
+  void setSeed(uint64_t seed) { random.setSeed(seed); }
+
+  /**
+   * Method: expand
+   * --------------
+   * Appends a random expansion of the nonterminal with the given ID
+   * to sentence.  Each terminal is followed by a space.
+   *
+   * @param nonterminal the ID of the nonterminal to expand (see Grammar::getNonterminal).
+   * @param sentence the string the expansion is appended to.
+   */
+
+  void expand(int nonterminal, string& sentence);
+
+ private:
+  const Grammar& grammar;
+  RandomGenerator random;
+  vector<pair<const int *, const int *> > stack;  // the next token and the end of each open production
+};
+
+#endif // ! __expander__
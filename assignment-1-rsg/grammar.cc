@@ -0,0 +1,649 @@
+/**
+ * File: grammar.cc
+ * ----------------
+ * Provides the implementation of the Grammar class, which
+ * compiles a grammar into flat arrays of integer tokens and
+ * keeps them in a single image that can be saved and mapped.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "grammar.h"
+
+/**
+ * An image starts out with this header, followed by the arrays
+ * firstProduction, productionStart, productionCut, productionAlias,
+ * tokens, terminalStart and nameStart, in that order, and then the
+ * characters of the names and of the terminals.  The numbers are
+ * stored as this machine stores them, so an image is only good on
+ * the kind of machine that saved it.
+ */
+
+static const char kImageMagic[8] = "RSGIMG2";
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t numNonterminals;
+  uint32_t numProductions;
+  uint32_t numTokens;
+  uint32_t numTerminals;
+  uint32_t namesSize;
+  uint32_t textSize;
+};
+
+/**
+ * Returns the number of bytes an image with the given header takes up.
+ * The counts in a header read from a file can be anything, so this is
+ * worked out in 64 bits, where none of it can overflow.
+ */
+
+static uint64_t sizeOfImage(const ImageHeader& header)
+{
+  uint64_t numOffsets = ((uint64_t) header.numNonterminals + 1) * 2 + (uint64_t) header.numProductions * 3 + 1 +
+    (uint64_t) header.numTerminals + 1;
+  return sizeof(ImageHeader) + sizeof(uint32_t) * numOffsets + sizeof(int32_t) * (uint64_t) header.numTokens +
+    header.namesSize + (uint64_t) header.textSize;
+}
+
+/**
+ * Class: WordTable
+ * ----------------
+ * Interns words, handing out the IDs 0, 1, 2, ... in the order the
+ * words are first seen.  It's an open-addressing hash table whose
+ * slots hold the top half of a word's hash next to its ID plus one
+ * (0 marks an empty slot), so a lookup usually reads one slot and
+ * compares one word.  Like the builder, it keeps views of its words.
+ */
+
+class WordTable {
+ public:
+  int intern(string_view word);
+  size_t size() const { return words.size(); }
+  string_view operator[](size_t id) const { return words[id]; }
+
+ private:
+  static uint64_t hash(string_view word);
+  void grow();
+
+  vector<uint64_t> slots = vector<uint64_t>(1024, 0);  // always a power of two, at most half full
+  vector<string_view> words;
+};
+
+/**
+ * FNV-1a: the words of a grammar are short, and this is hard to beat
+ * on short keys.
+ */
+
+uint64_t WordTable::hash(string_view word)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < word.size(); i++) {
+    hash ^= (unsigned char) word[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+int WordTable::intern(string_view word)
+{
+  uint64_t wordHash = hash(word);
+  size_t mask = slots.size() - 1;
+  for (size_t i = wordHash & mask; ; i = (i + 1) & mask) {
+    uint64_t slot = slots[i];
+    if (slot == 0) {
+      if ((words.size() + 1) * 2 > slots.size()) {
+        grow();
+        return intern(word);
+      }
+      words.push_back(word);
+      slots[i] = (wordHash & ~0xffffffffull) | words.size();
+      return words.size() - 1;
+    }
+    if ((slot >> 32) == (wordHash >> 32) && words[(uint32_t) slot - 1] == word) return (uint32_t) slot - 1;
+  }
+}
+
+void WordTable::grow()
+{
+  vector<uint64_t> old(slots.size() * 2, 0);
+  old.swap(slots);
+  size_t mask = slots.size() - 1;
+  for (size_t s = 0; s < old.size(); s++) {
+    if (old[s] == 0) continue;
+    size_t i = hash(words[(uint32_t) old[s] - 1]) & mask;
+    while (slots[i] != 0) i = (i + 1) & mask;
+    slots[i] = old[s];
+  }
+}
+
+/**
+ * Class: GrammarBuilder
+ * ---------------------
+ * Collects the definitions of a grammar in the order they are read,
+ * and lays them out as an image once they are all in.  As with the
+ * map readGrammar fills in, a nonterminal that is defined twice keeps
+ * the productions of its last definition.  A weight in brackets is
+ * only taken as one at the start of a production.  The builder keeps views of
+ * the names and words it is handed, so whatever holds them has to
+ * outlive it.
+ */
+
+class GrammarBuilder {
+ public:
+  void define(string_view nonterminal);
+  void addWord(string_view word);
+  void endProduction();
+  string build() const;
+
+ private:
+  int internNonterminal(string_view nonterminal);
+  void buildAliasTable(const uint32_t *weights, uint32_t count, uint32_t first,
+                       uint32_t *cut, uint32_t *alias) const;
+
+  WordTable names;                              // nonterminal ID <-> name
+  WordTable words;                              // terminal ID <-> word
+  vector<int> definitionOf;                     // nonterminal ID -> its last definition, or -1
+  vector<int> definitionNonterminal;            // definition -> the nonterminal it defines
+  int currentDefinition = -1;
+  vector<int> productionDefinition;             // production -> the definition it belongs to
+  vector<uint32_t> productionWeight;            // production -> its weight
+  uint32_t currentWeight = 0;                   // the current production's weight, or 0 if it has none yet
+  vector<uint32_t> productionStart = {0};       // production -> its first token, in reading order
+  vector<int32_t> tokens;
+};
+
+void GrammarBuilder::define(string_view nonterminal)
+{
+  int id = internNonterminal(nonterminal);
+  currentDefinition = definitionNonterminal.size();
+  definitionOf[id] = currentDefinition;
+  definitionNonterminal.push_back(id);
+}
+
+/**
+ * Returns the weight in a word like "[3]", or 0 if the word isn't a
+ * weight from 1 to kMaxWeight.
+ */
+
+static uint32_t parseWeight(string_view word)
+{
+  if (word.size() < 3 || word.size() > 9 || word.front() != '[' || word.back() != ']') return 0;
+  uint32_t weight = 0;
+  for (size_t i = 1; i + 1 < word.size(); i++) {
+    if (word[i] < '0' || word[i] > '9') return 0;
+    weight = weight * 10 + (word[i] - '0');
+  }
+  return weight <= Grammar::kMaxWeight ? weight : 0;
+}
+
+void GrammarBuilder::addWord(string_view word)
+{
+  if (currentWeight == 0 && tokens.size() == productionStart.back() && word[0] == '[') {
+    currentWeight = parseWeight(word);
+    if (currentWeight != 0) return;
+  }
+  if (word[0] == '<') tokens.push_back(-internNonterminal(word) - 1);  // see nonterminalOf
+  else tokens.push_back(words.intern(word));
+}
+
+void GrammarBuilder::endProduction()
+{
+  productionStart.push_back(tokens.size());
+  productionDefinition.push_back(currentDefinition);
+  productionWeight.push_back(currentWeight == 0 ? 1 : currentWeight);
+  currentWeight = 0;
+}
+
+int GrammarBuilder::internNonterminal(string_view nonterminal)
+{
+  int id = names.intern(nonterminal);
+  if (id == (int) definitionOf.size()) definitionOf.push_back(-1);
+  return id;
+}
+
+template <typename T>
+static void appendArray(string& image, const vector<T>& array)
+{
+  image.append((const char *) array.data(), array.size() * sizeof(T));
+}
+
+/**
+ * Returns share * 2^32 / total, rounded down, for a share less than the
+ * total: long division, a bit at a time, so the remainder never needs
+ * more than 64 bits (total is under 2^52, as no weight is over 2^20).
+ */
+
+static uint32_t scaleToThreshold(uint64_t share, uint64_t total)
+{
+  uint32_t threshold = 0;
+  for (int bit = 0; bit < 32; bit++) {
+    share <<= 1;
+    threshold <<= 1;
+    if (share >= total) {
+      share -= total;
+      threshold |= 1;
+    }
+  }
+  return threshold;
+}
+
+/**
+ * Method: buildAliasTable
+ * -----------------------
+ * Builds the alias table (Vose's version of Walker's method) for the
+ * count productions with the given weights, which start at production
+ * first.  Column i of the table is chosen with probability 1 / count,
+ * and then holds production first + i for a share of cut[i] / 2^32 of
+ * the time and production alias[i] for the rest.  Scaling every weight
+ * by count makes each column's capacity the total weight, so the table
+ * is filled in with exact integer arithmetic; only the thresholds are
+ * rounded down, to 32 bits (see scaleToThreshold).  A full column is its
+ * own alias, so the threshold of 2^32 it would need doesn't matter.
+ */
+
+void GrammarBuilder::buildAliasTable(const uint32_t *weights, uint32_t count, uint32_t first,
+                                     uint32_t *cut, uint32_t *alias) const
+{
+  uint64_t total = 0;
+  vector<uint64_t> scaled(count);
+  for (uint32_t i = 0; i < count; i++) {
+    total += weights[i];
+    scaled[i] = (uint64_t) weights[i] * count;
+  }
+
+  vector<uint32_t> small, large;
+  for (uint32_t i = 0; i < count; i++) (scaled[i] < total ? small : large).push_back(i);
+  while (!small.empty() && !large.empty()) {
+    uint32_t less = small.back(), more = large.back();
+    small.pop_back();
+    large.pop_back();
+    cut[less] = scaleToThreshold(scaled[less], total);
+    alias[less] = first + more;
+    scaled[more] -= total - scaled[less];
+    (scaled[more] < total ? small : large).push_back(more);
+  }
+  // the columns still open always hold total apiece between them, so only full ones are left
+  for (size_t i = 0; i < large.size(); i++) {
+    cut[large[i]] = 0xffffffff;
+    alias[large[i]] = first + large[i];
+  }
+}
+
+/**
+ * Method: build
+ * -------------
+ * The productions of each nonterminal have to be consecutive in the
+ * image, so they are sorted by nonterminal, keeping their reading
+ * order within each one (a counting sort), and those of definitions
+ * that were overridden are dropped.
+ */
+
+string GrammarBuilder::build() const
+{
+  size_t numProductions = productionDefinition.size();
+  vector<uint32_t> firstProduction(names.size() + 1, 0);
+  for (size_t p = 0; p < numProductions; p++) {
+    int nonterminal = definitionNonterminal[productionDefinition[p]];
+    if (definitionOf[nonterminal] == productionDefinition[p]) firstProduction[nonterminal + 1]++;
+  }
+  for (size_t n = 0; n < names.size(); n++) firstProduction[n + 1] += firstProduction[n];
+
+  vector<uint32_t> order(firstProduction.back());
+  vector<uint32_t> next(firstProduction.begin(), firstProduction.end() - 1);
+  for (size_t p = 0; p < numProductions; p++) {
+    int nonterminal = definitionNonterminal[productionDefinition[p]];
+    if (definitionOf[nonterminal] == productionDefinition[p]) order[next[nonterminal]++] = p;
+  }
+
+  vector<uint32_t> sortedStart(1, 0), sortedWeight;
+  vector<int32_t> sortedTokens;
+  for (size_t i = 0; i < order.size(); i++) {
+    sortedTokens.insert(sortedTokens.end(), tokens.begin() + productionStart[order[i]],
+                        tokens.begin() + productionStart[order[i] + 1]);
+    sortedStart.push_back(sortedTokens.size());
+    sortedWeight.push_back(productionWeight[order[i]]);
+  }
+
+  vector<uint32_t> cut(order.size()), alias(order.size());
+  for (size_t n = 0; n < names.size(); n++) {
+    uint32_t first = firstProduction[n], count = firstProduction[n + 1] - first;
+    buildAliasTable(&sortedWeight[first], count, first, &cut[first], &alias[first]);
+  }
+
+  string nameText, text;
+  vector<uint32_t> nameStart(1, 0), terminalStart(1, 0);
+  for (size_t n = 0; n < names.size(); n++) {
+    nameText.append(names[n]);
+    nameStart.push_back(nameText.size());
+  }
+  for (size_t t = 0; t < words.size(); t++) {
+    text.append(words[t]);
+    text += ' ';
+    terminalStart.push_back(text.size());
+  }
+
+  ImageHeader header;
+  memcpy(header.magic, kImageMagic, sizeof(header.magic));
+  header.numNonterminals = names.size();
+  header.numProductions = order.size();
+  header.numTokens = sortedTokens.size();
+  header.numTerminals = words.size();
+  header.namesSize = nameText.size();
+  header.textSize = text.size();
+
+  string image;
+  image.reserve(sizeOfImage(header));
+  image.append((const char *) &header, sizeof(header));
+  appendArray(image, firstProduction);
+  appendArray(image, sortedStart);
+  appendArray(image, cut);
+  appendArray(image, alias);
+  appendArray(image, sortedTokens);
+  appendArray(image, terminalStart);
+  appendArray(image, nameStart);
+  image += nameText;
+  image += text;
+  return image;
+}
+
+/**
+ * Constructor Implementation: Grammar
+ * -----------------------------------
+ * Nonterminals get their IDs in the order the definitions mention
+ * them, in the map's order rather than the file's.
+ */
+
+Grammar::Grammar(const map<string, Definition>& definitions)
+{
+  GrammarBuilder builder;
+  for (auto curr = definitions.begin(); curr != definitions.end(); ++curr) {
+    builder.define(curr->first);
+    const Definition& def = curr->second;
+    for (auto prod = def.begin(); prod != def.end(); ++prod) {
+      for (auto word = prod->begin(); word != prod->end(); ++word) builder.addWord(*word);
+      builder.endProduction();
+    }
+  }
+  ownedImage = builder.build();
+  useImage(ownedImage.data(), ownedImage.size());
+}
+
+Grammar::~Grammar()
+{
+  release();
+}
+
+void Grammar::release()
+{
+  if (mapped != NULL) munmap(mapped, mappedSize);
+  mapped = NULL;
+  mappedSize = 0;
+  ownedImage.clear();
+}
+
+/**
+ * Maps the named file read-only, and returns the mapping, or NULL if the
+ * file couldn't be opened or mapped or is empty.
+ */
+
+static void *mapFile(const string& fileName, size_t& size)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat info;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    size = info.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+/**
+ * Returns the characters of the next whitespace-delimited word, the way
+ * ifstream's >> would read it, and moves p past them.  The word is empty
+ * at the end of the text.
+ */
+
+static inline bool isSpace(char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');  // what isspace says in the "C" locale
+}
+
+static string_view nextWord(const char *& p, const char *end)
+{
+  while (p < end && isSpace(*p)) p++;
+  const char *word = p;
+  while (p < end && !isSpace(*p)) p++;
+  return string_view(word, p - word);
+}
+
+/**
+ * Returns the position just past the next c at or after p, or end if
+ * there isn't one.
+ */
+
+static const char *skipPast(const char *p, const char *end, char c)
+{
+  p = find(p, end, c);
+  return p == end ? end : p + 1;
+}
+
+/**
+ * Method: loadText
+ * ----------------
+ * Makes the same moves as readGrammar, Definition(ifstream&) and
+ * Production(ifstream&) do, right on the mapped text: skip to the next
+ * '{', read the nonterminal and drop the rest of its line, and read
+ * productions a line at a time until a line starts with '}'.  Words
+ * are handed to the builder as views into the mapping, which is only
+ * unmapped once the image is built.
+ */
+
+bool Grammar::loadText(const string& fileName, string *undefined)
+{
+  size_t size = 0;
+  const char *data = (const char *) mapFile(fileName, size);
+  if (data == NULL) {
+    ifstream exists(fileName);
+    if (exists.fail()) return false;  // an empty file is an empty grammar
+  }
+
+  GrammarBuilder builder;
+  const char *p = data, *end = data + size;
+  while ((p = skipPast(p, end, '{')) != end) {
+    builder.define(nextWord(p, end));
+    p = skipPast(p, end, '\n');
+    while (p < end && *p != '}') {
+      for (string_view word = nextWord(p, end); !word.empty() && word != ";"; word = nextWord(p, end))
+        builder.addWord(word);
+      builder.endProduction();
+      p = skipPast(p, end, '\n');
+    }
+    p = skipPast(p, end, '}');
+  }
+
+  string built = builder.build();
+  if (data != NULL) munmap((void *) data, size);
+  release();
+  ownedImage.swap(built);
+  useImage(ownedImage.data(), ownedImage.size());
+  if (!validImage(*(const ImageHeader *) image)) {
+    if (undefined != NULL) *undefined = findUndefined();
+    release();
+    numNonterminals = 0;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Method: loadImage
+ * -----------------
+ * The image has to be exactly as big as its header says, and then
+ * has to pass validImage, so that no index in it can lead outside it.
+ */
+
+bool Grammar::loadImage(const string& fileName)
+{
+  size_t size = 0;
+  void *data = mapFile(fileName, size);
+  if (data == NULL) return false;
+
+  const ImageHeader *header = (const ImageHeader *) data;
+  if (size < sizeof(ImageHeader) || memcmp(header->magic, kImageMagic, sizeof(kImageMagic)) != 0 ||
+      sizeOfImage(*header) != size) {
+    munmap(data, size);
+    return false;
+  }
+
+  release();
+  mapped = data;
+  mappedSize = size;
+  useImage((const char *) data, size);
+  if (!validImage(*header)) {
+    release();
+    numNonterminals = 0;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Points the arrays into the image at data, which is as big as its
+ * header says.
+ */
+
+void Grammar::useImage(const char *data, size_t size)
+{
+  const ImageHeader *header = (const ImageHeader *) data;
+  image = data;
+  imageSize = size;
+  numNonterminals = header->numNonterminals;
+  firstProduction = (const uint32_t *) (header + 1);
+  productionStart = firstProduction + header->numNonterminals + 1;
+  productionCut = productionStart + header->numProductions + 1;
+  productionAlias = productionCut + header->numProductions;
+  tokens = (const int32_t *) (productionAlias + header->numProductions);
+  terminalStart = (const uint32_t *) (tokens + header->numTokens);
+  nameStart = terminalStart + header->numTerminals + 1;
+  names = (const char *) (nameStart + header->numNonterminals + 1);
+  text = names + header->namesSize;
+}
+
+/**
+ * Returns true if the count + 1 offsets climb from 0 to last without
+ * ever going down.
+ */
+
+static bool ascending(const uint32_t *offsets, uint32_t count, uint32_t last)
+{
+  if (offsets[0] != 0 || offsets[count] != last) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    if (offsets[i] > offsets[i + 1]) return false;
+  }
+  return true;
+}
+
+/**
+ * Method: validImage
+ * ------------------
+ * Checks a mapped image before anything is expanded with it: every
+ * offset array has to climb through the array it indexes, every alias
+ * has to be a production, and every token has to be a terminal or a
+ * nonterminal with at least one production.  Together those keep
+ * getRandomProduction, productionBegin, productionEnd and getTerminal
+ * inside the image.  An image compiled from a grammar that uses a
+ * nonterminal it never defines fails this, too.
+ */
+
+bool Grammar::validImage(const ImageHeader& header) const
+{
+  if (!ascending(firstProduction, header.numNonterminals, header.numProductions) ||
+      !ascending(productionStart, header.numProductions, header.numTokens) ||
+      !ascending(terminalStart, header.numTerminals, header.textSize) ||
+      !ascending(nameStart, header.numNonterminals, header.namesSize)) return false;
+
+  for (uint32_t p = 0; p < header.numProductions; p++) {
+    if (productionAlias[p] >= header.numProductions) return false;
+  }
+  for (uint32_t t = 0; t < header.numTokens; t++) {
+    if (!isNonterminal(tokens[t])) {
+      if ((uint32_t) tokens[t] >= header.numTerminals) return false;
+    } else {
+      uint32_t nonterminal = nonterminalOf(tokens[t]);
+      if (nonterminal >= header.numNonterminals || !hasProductions(nonterminal)) return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns the name of the first nonterminal that a production uses but
+ * that has no productions of its own, or an empty string if there is
+ * none.  The builder writes every other part of an image correctly, so
+ * that's the one way a freshly built image fails validImage.
+ */
+
+string Grammar::findUndefined() const
+{
+  const ImageHeader *header = (const ImageHeader *) image;
+  for (uint32_t t = 0; t < header->numTokens; t++) {
+    if (!isNonterminal(tokens[t])) continue;
+    int nonterminal = nonterminalOf(tokens[t]);
+    if (!hasProductions(nonterminal))
+      return string(names + nameStart[nonterminal], nameStart[nonterminal + 1] - nameStart[nonterminal]);
+  }
+  return string();
+}
+
+bool Grammar::saveImage(const string& fileName) const
+{
+  ofstream outfile(fileName, ios::binary);
+  outfile.write(image, imageSize);
+  outfile.close();
+  return !outfile.fail();
+}
+
+bool Grammar::isImage(const string& fileName)
+{
+  char magic[sizeof(kImageMagic)];
+  ifstream infile(fileName, ios::binary);
+  infile.read(magic, sizeof(magic));
+  return !infile.fail() && memcmp(magic, kImageMagic, sizeof(magic)) == 0;
+}
+
+int Grammar::getNonterminal(const string& nonterminal) const
+{
+  for (uint32_t n = 0; n < numNonterminals; n++) {
+    if (string_view(names + nameStart[n], nameStart[n + 1] - nameStart[n]) == nonterminal) return n;
+  }
+  return -1;
+}
+
+/**
+ * Method: getRandomProduction
+ * ---------------------------
+ * The productions of a nonterminal are consecutive, and so are the
+ * columns of its alias table (see GrammarBuilder::buildAliasTable).
+ * The top 32 random bits pick a column the way getRandomInteger would,
+ * so a grammar without weights makes the same choices it always did,
+ * and the bottom 32 are held up to the column's threshold.
+ */
+
+int Grammar::getRandomProduction(int nonterminal, RandomGenerator& random) const
+{
+  uint32_t first = firstProduction[nonterminal], count = firstProduction[nonterminal + 1] - first;
+  assert(count > 0);
+  uint64_t bits = random.getRandomBits();
+  uint32_t column = first + (uint32_t) (((bits >> 32) * count) >> 32);
+  return (uint32_t) bits < productionCut[column] ? column : productionAlias[column];
+}
@@ -0,0 +1,219 @@
+/**
+ * File: grammar.h
+ * ---------------
+ * Defines the abstraction for the Grammar class, the compiled
+ * form of a grammar.  Every terminal and nonterminal is interned
+ * to an integer ID once, and the productions are laid out back to
+ * back in flat arrays of tokens, so that expanding a nonterminal is
+ * nothing but index chasing: no map lookups, no string compares,
+ * and no Productions copied.
+ *
+ * All of those arrays live in one block of memory, the grammar's
+ * image, which can be saved to a file as is.  A Grammar can be
+ * loaded three ways: compiled from the map<string, Definition> that
+ * readGrammar fills in, scanned straight from a memory-mapped .g file,
+ * or by memory-mapping an image saved before, which needs no parsing
+ * at all.
+ *
+ * A production can start with a weight in brackets, as in
+ *
+ *     [3] a heavier choice ;
+ *
+ * which makes it three times as likely to be chosen as a production
+ * without one (weight 1).  Weights go from 1 to kMaxWeight.  Each
+ * nonterminal's choice is made with an alias table (Walker's method)
+ * built at load time, so it takes constant time whatever the weights.
+ */
+
+#ifndef __grammar__
+#define __grammar__
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <stdint.h>
+#include "definition.h"
+#include "random.h"
+using namespace std;
+
+struct ImageHeader;
+
+class Grammar {
+
+ public:
+
+  /**
+   * The largest weight a production can have.  Anything in brackets
+   * that isn't a weight from 1 to this is an ordinary terminal.
+   */
+
+  static const uint32_t kMaxWeight = 1 << 20;
+
+  /**
+   * Default Constructor: Grammar
+   * ----------------------------
+   * Constructs an empty Grammar, to be filled in by loadText
+   * or loadImage.
+   */
+
+  Grammar() {}
+
+  /**
+   * Constructor: Grammar
+   * --------------------
+   * Compiles the definitions read in by readGrammar.  A nonterminal
+   * that is used but never defined still gets an ID, but has no
+   * productions to choose from.
+   *
+   * @param definitions the map from nonterminal strings to their definitions.
+   */
+
+  Grammar(const map<string, Definition>& definitions);
+
+  /**
+   * Destructor: ~Grammar
+   * --------------------
+   * Unmaps the image if it was memory-mapped from a file.
+   */
+
+  ~Grammar();
+
+  /**
+   * A Grammar may point into a memory-mapped file, so it can't be copied.
+   */
+
+  Grammar(const Grammar&) = delete;
+  Grammar& operator=(const Grammar&) = delete;
+
+  /**
+   * Method: loadText
+   * ----------------
+   * Replaces the grammar with the one in the named .g file, which is
+   * memory-mapped and scanned in a single pass, the way readGrammar
+   * would read it.  The file is assumed to be properly formatted, but
+   * a grammar that uses a nonterminal it never defines is rejected,
+   * and the grammar is left empty.
+   *
+   * @param undefined if not NULL, set to the name of the first
+   *                  undefined nonterminal when there is one.
+   * @return false if the file couldn't be opened or mapped, or uses an
+   *         undefined nonterminal.
+   */
+
+  bool loadText(const string& fileName, string *undefined = NULL);
+
+  /**
+   * Method: loadImage
+   * -----------------
+   * Replaces the grammar with the image saved by saveImage in the
+   * named file, which is memory-mapped, checked and used in place.
+   *
+   * @return false if the file couldn't be mapped or isn't a valid grammar image.
+   */
+
+  bool loadImage(const string& fileName);
+
+  /**
+   * Method: saveImage
+   * -----------------
+   * Writes the grammar's image to the named file, for loadImage.
+   *
+   * @return false if the file couldn't be written.
+   */
+
+  bool saveImage(const string& fileName) const;
+
+  /**
+   * Static Method: isImage
+   * ----------------------
+   * Returns true if the named file starts out like a grammar image.
+   */
+
+  static bool isImage(const string& fileName);
+
+  /**
+   * Method: getNonterminal
+   * ----------------------
+   * Returns the ID of the named nonterminal (with the '<' and '>'
+   * on either side), or -1 if the grammar never mentions it.
+   */
+
+  int getNonterminal(const string& nonterminal) const;
+
+  /**
+   * Method: hasProductions
+   * ----------------------
+   * Returns true if the nonterminal with the given ID has at least
+   * one production, and so can be expanded.
+   */
+
+  bool hasProductions(int nonterminal) const { return firstProduction[nonterminal + 1] > firstProduction[nonterminal]; }
+
+  /**
+   * Method: getRandomProduction
+   * ---------------------------
+   * Returns the index of one of the productions of the nonterminal
+   * with the given ID, chosen by weight with the specified generator.
+   * It is assumed that the nonterminal has at least one production.
+   */
+
+  int getRandomProduction(int nonterminal, RandomGenerator& random) const;
+
+  /**
+   * Methods: productionBegin, productionEnd
+   * ---------------------------------------
+   * Return pointers to the first token of the production with the given
+   * index and just past its last one.  A token is either a terminal or a
+   * nonterminal; see isNonterminal.
+   */
+
+  const int32_t *productionBegin(int production) const { return &tokens[productionStart[production]]; }
+  const int32_t *productionEnd(int production) const { return &tokens[productionStart[production + 1]]; }
+
+  /**
+   * Methods: isNonterminal, nonterminalOf
+   * -------------------------------------
+   * Nonterminals are stored as negative tokens, so that terminals can be
+   * stored as their own IDs: isNonterminal tells them apart, and
+   * nonterminalOf recovers the nonterminal ID of a negative token.
+   */
+
+  static bool isNonterminal(int token) { return token < 0; }
+  static int nonterminalOf(int token) { return -(token + 1); }
+
+  /**
+   * Method: getTerminal
+   * -------------------
+   * Returns the text a terminal adds to a sentence: the terminal
+   * itself followed by a space.
+   */
+
+  string_view getTerminal(int terminal) const {
+    return string_view(text + terminalStart[terminal], terminalStart[terminal + 1] - terminalStart[terminal]);
+  }
+
+ private:
+  void release();
+  void useImage(const char *data, size_t size);
+  bool validImage(const ImageHeader& header) const;
+  string findUndefined() const;
+
+  string ownedImage;                  // the image, unless it is mapped
+  void *mapped = NULL;                // the mapped image file, if any
+  size_t mappedSize = 0;
+
+  const char *image = NULL;           // ownedImage or mapped
+  size_t imageSize = 0;
+  uint32_t numNonterminals = 0;
+  const uint32_t *firstProduction;    // nonterminal ID -> its first production; one extra at the end
+  const uint32_t *productionStart;    // production -> its first token; one extra at the end
+  const uint32_t *productionCut;      // production -> its alias table column's threshold
+  const uint32_t *productionAlias;    // production -> the production chosen above the threshold
+  const int32_t *tokens;              // every production, back to back
+  const uint32_t *terminalStart;      // terminal ID -> where its text starts; one extra at the end
+  const uint32_t *nameStart;          // nonterminal ID -> where its name starts; one extra at the end
+  const char *names;
+  const char *text;                   // every terminal, each with its space
+};
+
+#endif // ! __grammar__
@@ -1,6 +1,4 @@
 #include <time.h>
-#include <stdlib.h>
-#include <limits.h>
 #include <cassert> // for assert macro
 #include "random.h"
 
@@ -15,23 +13,63 @@
 
 RandomGenerator::RandomGenerator()
 {
-  srand(time(NULL));
+  setSeed(time(NULL));
+}
+
+/**
+ * Method: setSeed
+ * ---------------
+ * Fills the xoshiro256** state from the seed with splitmix64, as its
+ * authors recommend, so that nearby seeds still give unrelated streams.
+ */
+
+void RandomGenerator::setSeed(uint64_t seed)
+{
+  for (int i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    state[i] = z ^ (z >> 31);
+  }
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * Method: next
+ * ------------
+ * Returns the next 64 bits of the xoshiro256** stream.
+ */
+
+uint64_t RandomGenerator::next()
+{
+  uint64_t result = rotl(state[1] * 5, 7) * 9;
+  uint64_t t = state[1] << 17;
+  state[2] ^= state[0];
+  state[3] ^= state[1];
+  state[1] ^= state[2];
+  state[0] ^= state[3];
+  state[2] ^= t;
+  state[3] = rotl(state[3], 45);
+  return result;
 }
 
 /**
  * Method: getRandomInteger
  * ------------------------
  * Returns a seemingly random number between
- * the specified low and high, inclusive.  Based
- * on Eric Roberts' implementation from his
- * CS106A text.
+ * the specified low and high, inclusive.  The top
+ * 32 bits of the stream are scaled to the range
+ * with a multiply and a shift, so no division or
+ * floating point is involved.
  */
 
 int RandomGenerator::getRandomInteger(int low, int high)
 {
   assert(low <= high);
-  double percent = (rand() / (static_cast<double>(RAND_MAX) + 1));
-  assert(percent >= 0.0 && percent < 1.0); 
-  int offset = static_cast<int>(percent * (high - low + 1));
-  return low + offset;
+  uint64_t range = (uint64_t) ((int64_t) high - low + 1);
+  return low + (int) (((next() >> 32) * range) >> 32);
 }
@@ -6,8 +6,14 @@
  * --------------
  * Provides a random number generator so
  * that pseudo-random numbers can be produced.
+ * Every RandomGenerator is a stream of its own
+ * (xoshiro256**), so threads that each own one
+ * need no locking, and a seeded one always
+ * produces the same numbers.
  */
 
+#include <stdint.h>
+
 class RandomGenerator {
   
  public: 
@@ -15,11 +21,29 @@ class RandomGenerator {
   /**
    * Constructor: RandomGenerator
    * ----------------------------
-   * Constructs a new RandomGenerator object.
+   * Constructs a new RandomGenerator object, seeded
+   * from the current time.
    */
   
   RandomGenerator();
 
+  /**
+   * Constructor: RandomGenerator
+   * ----------------------------
+   * Constructs a new RandomGenerator object with the
+   * given seed.
+   */
+
+  RandomGenerator(uint64_t seed) { setSeed(seed); }
+
+  /**
+   * Method: setSeed
+   * ---------------
+   * Restarts the generator on the stream for the given seed.
+   */
+
+  void setSeed(uint64_t seed);
+
   /**
    * Method: getRandomInteger
    * ------------------------
@@ -35,7 +59,21 @@ class RandomGenerator {
    */
   
   int getRandomInteger(int low, int high);  
+
+  /**
+   * Method: getRandomBits
+   * ---------------------
+   * Returns the next 64 random bits, for clients that
+   * want to split them up themselves.  The top 32 of
+   * them are what getRandomInteger would scale.
+   */
+
+  uint64_t getRandomBits() { return next(); }
+
+ private:
+  uint64_t next();
+
+  uint64_t state[4];
 };
 
 #endif // ! __random__
-
@@ -9,8 +9,17 @@
  
 #include <map>
 #include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include "definition.h"
 #include "production.h"
+#include "grammar.h"
+#include "expander.h"
 using namespace std;
 
 /**
@@ -40,18 +49,191 @@ static void readGrammar(ifstream& infile, map<string, Definition>& grammar)
 }
 
 /**
- * Recursively generates a random sentence using grammar map 
- * and a non-Terminal word.
+ * Bulk mode hands its sentences out in chunks of this many.  Chunk c is
+ * always expanded with the generator seeded from the run's seed and c,
+ * whichever thread expands it, so the output only depends on the seed.
  */
-string getRS(string nonTerm, map<string, Definition> &grammar) {
-  string result = "";
-  Production product = grammar[nonTerm].getRandomProduction();
-  for (auto i = product.begin(); i != product.end(); i++) {
-    string word = *i;
-    if (word[0] == '<') result += getRS(word, grammar);
-    else result += word + " ";
+static const long kBulkChunkSize = 4096;
+
+/**
+ * The number of chunk buffers per thread: while the main thread writes
+ * one chunk of a thread out, the thread can expand its next one.
+ */
+static const int kBulkSlotsPerThread = 2;
+
+/**
+ * Everything the threads of a bulk run share.  Chunk c is expanded into
+ * slots[c % slots.size()].  Since that is a multiple of the number of
+ * threads, a slot only ever holds the chunks of one thread: slotChunk
+ * says which chunk it is waiting for, and slotReady whether that chunk
+ * has been expanded into it and can be written out.
+ */
+struct BulkRun {
+  const Grammar& grammar;
+  int start;
+  long count;
+  long numChunks;
+  uint64_t seed;
+  int numThreads;
+  vector<string> slots;
+  vector<long> slotChunk;
+  vector<bool> slotReady;
+  mutex lock;
+  condition_variable changed;
+
+  BulkRun(const Grammar& grammar, int start, long count, uint64_t seed, int numThreads)
+    : grammar(grammar), start(start), count(count),
+      numChunks((count + kBulkChunkSize - 1) / kBulkChunkSize), seed(seed), numThreads(numThreads),
+      slots(numThreads * kBulkSlotsPerThread), slotChunk(slots.size()), slotReady(slots.size(), false) {
+    for (size_t s = 0; s < slots.size(); s++) slotChunk[s] = s;
+  }
+};
+
+/**
+ * Expands the chunks of one thread, chunk first, first + numThreads,
+ * and so on, each into its slot once the main thread is done with the
+ * chunk that was there before.  A sentence is expanded straight into
+ * the slot, with its trailing space turned into a line break.
+ */
+static void expandChunks(BulkRun& run, int first)
+{
+  Expander expander(run.grammar);
+  for (long c = first; c < run.numChunks; c += run.numThreads) {
+    size_t s = c % run.slots.size();
+    {
+      unique_lock<mutex> guard(run.lock);
+      run.changed.wait(guard, [&] { return run.slotChunk[s] == c; });
+    }
+    expander.setSeed(run.seed ^ (c * 0xd1b54a32d192ed03ull));
+    string& text = run.slots[s];
+    long end = min(run.count, (c + 1) * kBulkChunkSize);
+    for (long i = c * kBulkChunkSize; i < end; i++) {
+      expander.expand(run.start, text);
+      if (!text.empty() && text.back() == ' ') text.back() = '\n';
+      else text += '\n';
+    }
+    lock_guard<mutex> guard(run.lock);
+    run.slotReady[s] = true;
+    run.changed.notify_all();
   }
-  return result;
+}
+
+/**
+ * Writes count random expansions of start to the named file, one per
+ * line, and reports how fast that went.  numThreads threads expand the
+ * sentences chunk by chunk (see expandChunks), and this thread writes
+ * the chunks out in order as they become ready, so the file is the same
+ * for a given seed however many threads there are.
+ *
+ * @param grammar the compiled grammar.
+ * @param start the ID of the nonterminal every sentence expands.
+ * @param count the number of sentences to write.
+ * @param outFileName the name of the file the sentences go to.
+ * @param numThreads the number of threads that expand sentences.
+ * @param seed the seed all random choices derive from.
+ * @return false if the file couldn't be written.
+ */
+
+static bool generateBulk(const Grammar& grammar, int start, long count, const char *outFileName,
+                         int numThreads, uint64_t seed)
+{
+  ofstream outfile(outFileName, ios::binary);
+  if (outfile.fail()) return false;
+
+  auto startTime = chrono::steady_clock::now();
+  BulkRun run(grammar, start, count, seed, numThreads);
+  vector<thread> threads;
+  for (int t = 0; t < numThreads; t++) threads.push_back(thread(expandChunks, ref(run), t));
+
+  double bytesWritten = 0;
+  for (long c = 0; c < run.numChunks; c++) {
+    size_t s = c % run.slots.size();
+    {
+      unique_lock<mutex> guard(run.lock);
+      run.changed.wait(guard, [&] { return run.slotReady[s]; });
+    }
+    outfile.write(run.slots[s].data(), run.slots[s].size());
+    bytesWritten += run.slots[s].size();
+    run.slots[s].clear();
+    lock_guard<mutex> guard(run.lock);
+    run.slotReady[s] = false;
+    run.slotChunk[s] = c + run.slots.size();
+    run.changed.notify_all();
+  }
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+  outfile.close();
+  if (outfile.fail()) return false;
+
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+  double megabytes = bytesWritten / (1024 * 1024);
+  cout << "Wrote " << count << " sentences (" << megabytes << " MB) to \"" << outFileName
+       << "\" in " << seconds << " seconds with " << numThreads << " thread(s), seed " << seed
+       << ": " << count / seconds << " sentences/sec, " << megabytes / seconds << " MB/s." << endl;
+  return true;
+}
+
+/**
+ * Each way of loading a grammar is timed this many times, and the best
+ * time is the one reported, since a single load of a small grammar is
+ * over too quickly to time reliably.
+ */
+static const int kLoadTimings = 10;
+
+/**
+ * Returns the best time, in microseconds, that load took out of
+ * kLoadTimings calls.
+ */
+template <typename Load>
+static double bestLoadTime(Load load)
+{
+  double best = 0;
+  for (int i = 0; i < kLoadTimings; i++) {
+    auto startTime = chrono::steady_clock::now();
+    load();
+    double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - startTime).count();
+    if (i == 0 || micros < best) best = micros;
+  }
+  return best;
+}
+
+/**
+ * Compiles the grammar in the named text file, saves its image to the
+ * named image file, and reports how long loading the grammar takes
+ * each way: with readGrammar's ifstream parser, with the scanner over
+ * the mapped text, and by mapping the image.
+ *
+ * @return 0 if all went well, or the exit code main should return.
+ */
+
+static int compileGrammar(const char *grammarFileName, const char *imageFileName)
+{
+  Grammar grammar;
+  string undefined;
+  if (!grammar.loadText(grammarFileName, &undefined)) {
+    if (!undefined.empty()) {
+      cerr << "The grammar in \"" << grammarFileName << "\" uses the undefined nonterminal " << undefined << "." << endl;
+      return 5;
+    }
+    cerr << "Failed to open the file named \"" << grammarFileName << "\".  Check to ensure the file exists. " << endl;
+    return 2;
+  }
+  if (!grammar.saveImage(imageFileName)) {
+    cerr << "Failed to write the file named \"" << imageFileName << "\"." << endl;
+    return 4;
+  }
+
+  double parsed = bestLoadTime([&] {
+    ifstream grammarFile(grammarFileName);
+    map<string, Definition> definitions;
+    readGrammar(grammarFile, definitions);
+    Grammar parsedGrammar(definitions);
+  });
+  double scanned = bestLoadTime([&] { Grammar scannedGrammar; scannedGrammar.loadText(grammarFileName); });
+  double mapped = bestLoadTime([&] { Grammar mappedGrammar; mappedGrammar.loadImage(imageFileName); });
+  cout << "Compiled \"" << grammarFileName << "\" to \"" << imageFileName << "\".  Best load time of "
+       << kLoadTimings << ": ifstream parser " << parsed << " us, mapped scanner " << scanned
+       << " us, mapped image " << mapped << " us." << endl;
+  return 0;
 }
 
 /**
@@ -63,9 +245,17 @@ string getRS(string nonTerm, map<string, Definition> &grammar) {
  * three randomly generated sentences, as illustrated by the sample
  * application.
  *
+ * Given a sentence count and an output file after the grammar file,
+ * it writes that many sentences to the file instead (see generateBulk),
+ * optionally with a number of threads and a seed after them.
+ *
+ * The grammar file is memory-mapped and scanned (see Grammar::loadText),
+ * or, if it is an image saved by "rsg -c <grammar file> <image file>"
+ * (see compileGrammar), mapped and used as it is.
+ *
  * @param argc the number of tokens making up the command that invoked
  *             the RSG executable.  There must be at least two arguments,
- *             and only the first two are used.
+ *             and only the first six are used.
  * @param argv the sequence of tokens making up the command, where each
  *             token is represented as a '\0'-terminated C string.
  */
@@ -74,27 +264,73 @@ int main(int argc, char *argv[])
 {
   if (argc == 1) {
     cerr << "You need to specify the name of a grammar file." << endl;
-    cerr << "Usage: rsg <path to grammar text file>" << endl;
+    cerr << "Usage: rsg <path to grammar text file> [<sentence count> <output file> [<threads> [<seed>]]]" << endl;
+    cerr << "       rsg -c <path to grammar text file> <image file>" << endl;
     return 1; // non-zero return value means something bad happened 
   }
+
+  if (strcmp(argv[1], "-c") == 0) {
+    if (argc != 4) {
+      cerr << "Usage: rsg -c <path to grammar text file> <image file>" << endl;
+      return 1;
+    }
+    return compileGrammar(argv[2], argv[3]);
+  }
+
+  long bulkCount = 0;
+  int numThreads = 1;
+  uint64_t seed = time(NULL);
+  if (argc >= 3) {
+    bulkCount = atol(argv[2]);
+    if (argc >= 5) numThreads = atoi(argv[4]);
+    if (argc >= 6) seed = strtoull(argv[5], NULL, 10);
+    if (argc < 4 || bulkCount <= 0 || numThreads <= 0) {
+      cerr << "Bulk mode needs a positive sentence count, an output file, and a positive number of threads." << endl;
+      cerr << "Usage: rsg <path to grammar text file> [<sentence count> <output file> [<threads> [<seed>]]]" << endl;
+      return 1;
+    }
+  }
   
-  ifstream grammarFile(argv[1]);
-  if (grammarFile.fail()) {
+  Grammar grammar;
+  string undefined;
+  if (Grammar::isImage(argv[1])) {
+    if (!grammar.loadImage(argv[1])) {
+      cerr << "The file named \"" << argv[1] << "\" isn't a valid grammar image." << endl;
+      return 2;
+    }
+  } else if (!grammar.loadText(argv[1], &undefined)) {
+    if (!undefined.empty()) {
+      cerr << "The grammar in \"" << argv[1] << "\" uses the undefined nonterminal " << undefined << "." << endl;
+      return 5;
+    }
     cerr << "Failed to open the file named \"" << argv[1] << "\".  Check to ensure the file exists. " << endl;
     return 2; // each bad thing has its own bad return value
   }
   
   // things are looking good...
-  map<string, Definition> grammar;
-  readGrammar(grammarFile, grammar);
+  int start = grammar.getNonterminal("<start>");
+  if (start == -1 || !grammar.hasProductions(start)) {
+    cerr << "The grammar in \"" << argv[1] << "\" has no <start> nonterminal to expand." << endl;
+    return 3;
+  }
+
+  if (bulkCount > 0) {
+    if (!generateBulk(grammar, start, bulkCount, argv[3], numThreads, seed)) {
+      cerr << "Failed to write the file named \"" << argv[3] << "\"." << endl;
+      return 4;
+    }
+    return 0;
+  }
 
   // assignment code
-  cout << "Version #1 -------------------------" << endl;
-  cout << getRS("<start>", grammar) << endl << endl;
-  cout << "Version #2 -------------------------" << endl;
-  cout << getRS("<start>", grammar) << endl << endl;
-  cout << "Version #3 -------------------------" << endl;
-  cout << getRS("<start>", grammar) << endl << endl;
+  Expander expander(grammar);
+  string sentence;
+  for (int version = 1; version <= 3; version++) {
+    sentence.clear();
+    expander.expand(start, sentence);
+    cout << "Version #" << version << " -------------------------" << endl;
+    cout << sentence << endl << endl;
+  }
   
   return 0;
 }
\ No newline at end of file
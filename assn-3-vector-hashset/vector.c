@@ -90,6 +90,57 @@ void VectorMap(vector *v, VectorMapFunction mapFn, void *auxData)
     }
 }
 
+/* Heap order for VectorTopK: ties are broken by position in the vector. */
+static bool TopKIsWorse(const void *a, const void *b, VectorCompareFunction compare)
+{
+    int cmp = compare(a, b);
+    return cmp != 0 ? cmp > 0 : a > b;
+}
+
+static void TopKSiftDown(void *heap[], int size, int i, VectorCompareFunction compare)
+{
+    while (true) {
+        int worst = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < size && TopKIsWorse(heap[l], heap[worst], compare)) worst = l;
+        if (r < size && TopKIsWorse(heap[r], heap[worst], compare)) worst = r;
+        if (worst == i) return;
+        void *tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+int VectorTopK(const vector *v, VectorCompareFunction compare, int k, void *topElems[])
+{
+    assert(compare != NULL && topElems != NULL);
+    assert(k >= 0);
+    int size = 0;
+    for (int i = 0; i < v->logSize; i++) {
+        void *elem = (char *)v->elems + i * v->elemSize;
+        if (size < k) {
+            int child = size++;
+            topElems[child] = elem;
+            while (child > 0 && TopKIsWorse(topElems[child], topElems[(child - 1) / 2], compare)) {
+                void *tmp = topElems[child];
+                topElems[child] = topElems[(child - 1) / 2];
+                topElems[(child - 1) / 2] = tmp;
+                child = (child - 1) / 2;
+            }
+        } else if (k > 0 && TopKIsWorse(topElems[0], elem, compare)) {
+            topElems[0] = elem;
+            TopKSiftDown(topElems, size, 0, compare);
+        }
+    }
+    for (int last = size - 1; last > 0; last--) {
+        void *tmp = topElems[0];
+        topElems[0] = topElems[last];
+        topElems[last] = tmp;
+        TopKSiftDown(topElems, last, 0, compare);
+    }
+    return size;
+}
+
 static const int kNotFound = -1;
 int VectorSearch(const vector *v, const void *key, VectorCompareFunction searchFn, int startIndex, bool isSorted)
 {
@@ -258,6 +258,24 @@ int VectorSearch(const vector *v, const void *key, VectorCompareFunction searchf
 
 void VectorSort(vector *v, VectorCompareFunction comparefn);
 
+/**
+ * Function: VectorTopK
+ * --------------------
+ * Selects the k smallest elements of the vector according to the supplied
+ * comparator without sorting or otherwise rearranging the vector.  The
+ * addresses of the selected elements are written to topElems in ascending
+ * order, and the number of addresses written (the smaller of k and the logical
+ * length) is returned.  Elements that compare equal keep their relative order
+ * in the vector.  topElems must have room for k pointers.  The selection keeps
+ * a bounded heap of k candidates, so it runs in O(n log k) time, which beats
+ * VectorSort when only the first few elements of a large vector are needed.
+ * Like VectorNth, the returned pointers address the vector's storage and become
+ * invalid after any call that inserts, deletes or sorts.  An assert is raised if
+ * the comparator or topElems is NULL or if k is negative.
+ */
+
+int VectorTopK(const vector *v, VectorCompareFunction comparefn, int k, void *topElems[]);
+
 /**
  * Method: VectorMap
  * -----------------
@@ -241,6 +241,30 @@ static int LongCompare(const void *vp1, const void *vp2)
   return (*(const long *)vp1) - (*(const long *)vp2);
 }
 
+/**
+ * Function: SelectSmallest
+ * ------------------------
+ * Uses VectorTopK to pick the smallest few numbers out of the
+ * (still unsorted) permutation, and confirms that they come back
+ * in order and that the vector itself was left untouched.
+ */
+
+static void SelectSmallest(vector *numbers)
+{
+  const int kNumSmallest = 10;
+  void *smallest[kNumSmallest];
+  long first = *(const long *) VectorNth(numbers, 0);
+  fprintf(stdout, "Selecting the %d smallest of those numbers. ", kNumSmallest);
+  fflush(stdout);
+  int found = VectorTopK(numbers, LongCompare, kNumSmallest, smallest);
+  assert(found == kNumSmallest);
+  for (long i = 0; i < found; i++)
+    assert(*(const long *) smallest[i] == i);
+  assert(*(const long *) VectorNth(numbers, 0) == first);
+  fprintf(stdout, "[Got 0 through %d]\n", kNumSmallest - 1);
+  fflush(stdout);
+}
+
 /**
  * Function: SortPermutation
  * -------------------------
@@ -317,6 +341,7 @@ static void ChallengingTest()
   fprintf(stdout, "\n\n------------------------- Starting the more advanced tests...\n");  
   VectorNew(&lotsOfNumbers, sizeof(long), NULL, 4);
   InsertPermutationOfNumbers(&lotsOfNumbers, kLargePrime, kEvenLargerPrime);
+  SelectSmallest(&lotsOfNumbers);
   SortPermutation(&lotsOfNumbers);
   DeleteEverythingVerySlowly(&lotsOfNumbers);
   VectorDispose(&lotsOfNumbers);
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Measures how many articles per second the indexer gets through over a
+# local corpus of HTML files, for several indexer thread counts.
+#
+# usage: ./bench-index.sh [<corpus dir> [<thread counts>]]
+#
+# Every *.html/*.htm/*.txt file under the corpus directory is indexed as one
+# article through a file:// feed.  Without a corpus directory, one is made
+# up from copies of the sample articles in data/.
+
+PROG=./rss-news-search
+CORPUS=$1
+THREADS=${2:-"1 2 4 8"}
+FEEDS=$(mktemp)
+
+if [ -z "$CORPUS" ]; then
+  CORPUS=$(mktemp -d)
+  CLEAN_CORPUS=$CORPUS
+  for i in $(seq 1 400); do
+    for f in tmp_doc data/test1.txt data/test2.txt data/test3.txt; do
+      cp "$f" "$CORPUS/$i-$(basename "$f").html"
+    done
+  done
+fi
+
+find "$CORPUS" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.txt' \) |
+  sed 's|^|article: file://|' > "$FEEDS"
+echo "corpus: $CORPUS ($(wc -l < "$FEEDS") articles)"
+
+for n in $THREADS; do
+  echo | $PROG -b -j "$n" "$FEEDS" | grep '^Indexed'
+done
+
+rm -f "$FEEDS"
+[ -n "$CLEAN_CORPUS" ] && rm -rf "$CLEAN_CORPUS"
@@ -0,0 +1,223 @@
+/**
+ * File: crawl-cache.c
+ * -------------------
+ * Implements the crawl cache.  The cache file is plain text: a version
+ * line, then for every page a tab-separated header line
+ *
+ *   page <body hash> <numWords> <numTerms> <URL> <ETag> <Last-Modified> <longest word>
+ *
+ * followed by numTerms lines of the form "<count>\t<word>".
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crawl-cache.h"
+
+#define NUM_BUCKETS_PAGES 1009
+
+static const char *const kCacheVersion = "rss-news-search crawl cache 1";
+
+uint64_t CrawlCacheHash(const char *data, long length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (long i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+  return hash;
+}
+
+static int PageHash(const void *elemAddr, int numBuckets) {
+  const char *URL = (*(cachedPage **)elemAddr)->URL;
+  return CrawlCacheHash(URL, strlen(URL)) % numBuckets;
+}
+
+static int PageCmp(const void *elemAddr1, const void *elemAddr2) {
+  return strcmp((*(cachedPage **)elemAddr1)->URL, (*(cachedPage **)elemAddr2)->URL);
+}
+
+static void TermFree(void *elemAddr) {
+  free(((cachedTerm *)elemAddr)->word);
+}
+
+static void PageFree(void *elemAddr) {
+  cachedPage *page = *(cachedPage **)elemAddr;
+  free(page->URL);
+  free(page->etag);
+  free(page->lastModified);
+  free(page->longestWord);
+  VectorDispose(&page->terms);
+  free(page);
+}
+
+/*
+ * Function: CopyField
+ * -------------------
+ * strdup that turns tabs and line breaks into spaces, so that no string
+ * can break the line structure of the cache file.  NULL copies as "".
+ */
+static char *CopyField(const char *field) {
+  char *copy = strdup(field == NULL ? "" : field);
+  assert(copy != NULL);
+  for (char *ch = copy; *ch != '\0'; ch++)
+    if (*ch == '\t' || *ch == '\n' || *ch == '\r') *ch = ' ';
+  return copy;
+}
+
+static cachedPage *PageNew(const char *URL, const char *etag, const char *lastModified,
+                           uint64_t bodyHash, int numWords, const char *longestWord, int numTerms) {
+  cachedPage *page = malloc(sizeof(cachedPage));
+  assert(page != NULL);
+  page->URL = CopyField(URL);
+  page->etag = CopyField(etag);
+  page->lastModified = CopyField(lastModified);
+  page->bodyHash = bodyHash;
+  page->numWords = numWords;
+  page->longestWord = CopyField(longestWord);
+  VectorNew(&page->terms, sizeof(cachedTerm), TermFree, numTerms > 0 ? numTerms : 1);
+  return page;
+}
+
+static void AppendTerm(cachedPage *page, const char *word, int count) {
+  cachedTerm term;
+  term.word = CopyField(word);
+  term.count = count;
+  VectorAppend(&page->terms, &term);
+}
+
+/*
+ * Function: NextField
+ * -------------------
+ * Splits the next tab-separated field off the line (see strsep).  The
+ * last field has its line break removed.
+ */
+static char *NextField(char **line) {
+  char *field = strsep(line, "\t");
+  if (field != NULL && *line == NULL) field[strcspn(field, "\r\n")] = '\0';
+  return field;
+}
+
+/*
+ * Function: LoadPages
+ * -------------------
+ * Reads the pages of the cache file into the previous table.  Reading
+ * stops quietly at the first malformed line; whatever was read up to
+ * there is still used.
+ */
+static void LoadPages(crawlcache *cache, FILE *infile) {
+  char *line = NULL;
+  size_t allocatedLength = 0;
+
+  if (getline(&line, &allocatedLength, infile) == -1 ||
+      strncmp(line, kCacheVersion, strlen(kCacheVersion)) != 0) {
+    free(line);
+    return;
+  }
+  while (getline(&line, &allocatedLength, infile) != -1) {
+    char *rest = line;
+    char *fields[8];
+    int numFields = 0;
+    while (numFields < 8 && (fields[numFields] = NextField(&rest)) != NULL) numFields++;
+    if (numFields != 8 || strcmp(fields[0], "page") != 0) break;
+
+    int numTerms = atoi(fields[3]);
+    cachedPage *page = PageNew(fields[4], fields[5], fields[6], strtoull(fields[1], NULL, 16),
+                               atoi(fields[2]), fields[7], numTerms);
+    bool complete = true;
+    for (int i = 0; i < numTerms && complete; i++) {
+      complete = getline(&line, &allocatedLength, infile) != -1;
+      rest = line;
+      char *count = NextField(&rest), *word = NextField(&rest);
+      complete = complete && word != NULL && *word != '\0';
+      if (complete) AppendTerm(page, word, atoi(count));
+    }
+    if (!complete) {
+      PageFree(&page);
+      break;
+    }
+    HashSetEnter(&cache->previous, &page);
+  }
+  free(line);
+}
+
+void CrawlCacheNew(crawlcache *cache, const char *fileName) {
+  cache->fileName = strdup(fileName);
+  HashSetNew(&cache->previous, sizeof(cachedPage *), NUM_BUCKETS_PAGES, PageHash, PageCmp, PageFree);
+  HashSetNew(&cache->current, sizeof(cachedPage *), NUM_BUCKETS_PAGES, PageHash, PageCmp, PageFree);
+  memset(cache->numRecorded, 0, sizeof(cache->numRecorded));
+  pthread_mutex_init(&cache->lock, NULL);
+
+  FILE *infile = fopen(fileName, "r");
+  if (infile == NULL) return;
+  LoadPages(cache, infile);
+  fclose(infile);
+}
+
+void CrawlCacheDispose(crawlcache *cache) {
+  HashSetDispose(&cache->previous);
+  HashSetDispose(&cache->current);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->fileName);
+}
+
+const cachedPage *CrawlCacheLookup(crawlcache *cache, const char *URL) {
+  cachedPage key;
+  cachedPage *keyAddr = &key;
+  key.URL = (char *)URL;
+  cachedPage **found = HashSetLookup(&cache->previous, &keyAddr);
+  return (found == NULL) ? NULL : *found;
+}
+
+void CrawlCacheRecord(crawlcache *cache, const char *URL, const char *etag, const char *lastModified,
+                      uint64_t bodyHash, int numWords, const char *longestWord, const vector *terms,
+                      pageStatus status) {
+  cachedPage *page = PageNew(URL, etag, lastModified, bodyHash, numWords, longestWord,
+                             VectorLength(terms));
+  for (int i = 0; i < VectorLength(terms); i++) {
+    const cachedTerm *term = VectorNth(terms, i);
+    AppendTerm(page, term->word, term->count);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  HashSetEnter(&cache->current, &page);   // a URL seen twice keeps its latest page
+  cache->numRecorded[status]++;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+int CrawlCacheCount(crawlcache *cache, pageStatus status) {
+  pthread_mutex_lock(&cache->lock);
+  int count = cache->numRecorded[status];
+  pthread_mutex_unlock(&cache->lock);
+  return count;
+}
+
+static void WritePage(void *elemAddr, void *auxData) {
+  const cachedPage *page = *(cachedPage **)elemAddr;
+  FILE *outfile = auxData;
+  fprintf(outfile, "page\t%016" PRIx64 "\t%d\t%d\t%s\t%s\t%s\t%s\n", page->bodyHash, page->numWords,
+          VectorLength(&page->terms), page->URL, page->etag, page->lastModified, page->longestWord);
+  for (int i = 0; i < VectorLength(&page->terms); i++) {
+    const cachedTerm *term = VectorNth(&page->terms, i);
+    fprintf(outfile, "%d\t%s\n", term->count, term->word);
+  }
+}
+
+bool CrawlCacheSave(crawlcache *cache) {
+  char tempFileName[strlen(cache->fileName) + 5];
+  sprintf(tempFileName, "%s.tmp", cache->fileName);
+  FILE *outfile = fopen(tempFileName, "w");
+  if (outfile == NULL) return false;
+
+  fprintf(outfile, "%s\n", kCacheVersion);
+  pthread_mutex_lock(&cache->lock);
+  HashSetMap(&cache->current, WritePage, outfile);
+  pthread_mutex_unlock(&cache->lock);
+  bool written = !ferror(outfile);
+  written = (fclose(outfile) == 0) && written;
+  if (!written || rename(tempFileName, cache->fileName) != 0) {
+    remove(tempFileName);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,149 @@
+#ifndef __crawlcache_
+#define __crawlcache_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "bool.h"
+#include "hashset.h"
+#include "vector.h"
+
+/* File: crawl-cache.h
+ * -------------------
+ * Defines the interface for the crawl cache: what the previous crawl learned
+ * about every article it fetched, kept in a file between runs.  For each
+ * URL the cache remembers the validators the server sent (ETag and
+ * Last-Modified), a hash of the body, and the word counts the article was
+ * indexed with.  The next crawl sends the validators along with its request,
+ * and when the server answers 304 Not Modified (or sends the very same body
+ * again) the article is indexed from the cached word counts instead of being
+ * tokenized all over again.
+ */
+
+/**
+ * Type: cachedTerm
+ * ----------------
+ * One (non stop-word) term of a cached article and the number of
+ * times it occurs there.
+ */
+
+typedef struct {
+  char *word;
+  int count;
+} cachedTerm;
+
+/**
+ * Type: cachedPage
+ * ----------------
+ * Everything the cache knows about one article.  etag and lastModified
+ * are empty strings if the server didn't send them.
+ */
+
+typedef struct {
+  char *URL;
+  char *etag;
+  char *lastModified;
+  uint64_t bodyHash;
+  int numWords;          // well-formed words, including duplicates and stop words
+  char *longestWord;
+  vector terms;          // of cachedTerm
+} cachedPage;
+
+/**
+ * Type: pageStatus
+ * ----------------
+ * How an article fetched during this crawl compared to the cached copy.
+ */
+
+typedef enum {
+  PageChanged,           // new, changed, or fetched without a usable cache entry
+  PageNotModified,       // the server answered 304 Not Modified
+  PageSameContent        // the server resent a body identical to the cached one
+} pageStatus;
+
+/**
+ * Type: crawlcache
+ * ----------------
+ * The pages loaded from the cache file are kept apart from the pages
+ * recorded during this crawl: the former are never changed once loaded,
+ * so indexer threads can look them up without locking, and only the latter
+ * need the lock.  Saving writes out the pages recorded during this crawl,
+ * so articles that dropped out of every feed drop out of the cache too.
+ */
+
+typedef struct {
+  char *fileName;
+  hashset previous;      // of cachedPage *, as loaded from the file
+  hashset current;       // of cachedPage *, recorded during this crawl
+  int numRecorded[3];    // indexed by pageStatus
+  pthread_mutex_t lock;  // guards current and numRecorded
+} crawlcache;
+
+/**
+ * Function: CrawlCacheNew
+ * Usage: CrawlCacheNew(&cache, "rss-crawl.cache");
+ * ------------------------------------------------
+ * Initializes the cache and loads the pages saved by the previous crawl
+ * from the named file.  A missing or unreadable file just means an empty
+ * cache.
+ */
+
+void CrawlCacheNew(crawlcache *cache, const char *fileName);
+
+/**
+ * Function: CrawlCacheDispose
+ * ---------------------------
+ * Releases all of the memory held by the cache.  Nothing is saved.
+ */
+
+void CrawlCacheDispose(crawlcache *cache);
+
+/**
+ * Function: CrawlCacheLookup
+ * --------------------------
+ * Returns the page saved for the URL by the previous crawl, or NULL if
+ * there is none.  The page belongs to the cache and stays valid until the
+ * cache is disposed.  Safe to call from any thread without locking.
+ */
+
+const cachedPage *CrawlCacheLookup(crawlcache *cache, const char *URL);
+
+/**
+ * Function: CrawlCacheRecord
+ * --------------------------
+ * Records what was learned about the URL during this crawl.  The strings
+ * and the terms (a vector of cachedTerm) are copied, so the caller keeps
+ * ownership of everything passed in.  Safe to call from any thread.
+ */
+
+void CrawlCacheRecord(crawlcache *cache, const char *URL, const char *etag, const char *lastModified,
+                      uint64_t bodyHash, int numWords, const char *longestWord, const vector *terms,
+                      pageStatus status);
+
+/**
+ * Function: CrawlCacheCount
+ * -------------------------
+ * Returns how many pages were recorded during this crawl with the
+ * given status.
+ */
+
+int CrawlCacheCount(crawlcache *cache, pageStatus status);
+
+/**
+ * Function: CrawlCacheSave
+ * ------------------------
+ * Writes the pages recorded during this crawl to the cache file, replacing
+ * it atomically.  Returns false if the file couldn't be written.
+ */
+
+bool CrawlCacheSave(crawlcache *cache);
+
+/**
+ * Function: CrawlCacheHash
+ * ------------------------
+ * 64-bit FNV-1a hash of a response body, used to recognize a body
+ * that is byte for byte the one the cache has seen before.
+ */
+
+uint64_t CrawlCacheHash(const char *data, long length);
+
+#endif
@@ -1,56 +1,214 @@
 #include <assert.h>
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 
 #include "bool.h"
+#include "crawl-cache.h"
 #include "html-utils.h"
 #include "streamtokenizer.h"
 #include "url.h"
 #include "urlconnection.h"
 #include "hashset.h"
+#include "stop-words.h"
 
-#define NUM_BUCKETS_STOP 1009
-#define NUM_BUCKETS_DATA 10007
+#define NUM_BUCKETS_ARTICLES 1009
+#define NUM_BUCKETS_ARTICLE_TERMS 1009
+#define NUM_INDEX_SHARDS 31
+#define NUM_BUCKETS_SHARD 1021
+#define MAX_INDEXERS 64
+
+/*
+ * An Article is stored once in the article table of the database,
+ * and the index refers to it by its position in that table (articleID).
+ * numTerms counts the indexed (non stop-word) terms of the article
+ * and is used to normalize the ranking by document length.
+ */
+typedef struct {
+  char *URL;
+  char *title;
+  char *serverName;
+  int numTerms;
+} Article;
+
+/*
+ * A Posting records how many times a word occurs in one article.
+ * Every postings vector is kept sorted by articleID, so that the
+ * postings of several words can be intersected or merged in one pass.
+ */
+typedef struct {
+  int articleID;
+  int freq;
+} Posting;
 
 typedef struct {
   char *first;
   vector *second;
 } MapPair;
 
+/*
+ * Lookup entry used to find an already registered article by its URL or
+ * title.  The key is borrowed from the Article and is not freed here.
+ */
+typedef struct {
+  const char *key;
+  int articleID;
+} ArticleKey;
+
+/*
+ * Count of one word within the article being scanned, along with
+ * the index shard the word belongs to.
+ */
+typedef struct {
+  char *word;
+  int count;
+  int shard;
+} WordCount;
+
+/*
+ * The indices are split into shards by the hash of the word, each with
+ * its own lock, so indexer threads merging different words don't wait
+ * on each other.
+ */
+typedef struct {
+  hashset indices;
+  pthread_mutex_t lock;
+} indexShard;
+
+/*
+ * An article waiting to be fetched and indexed.  Local articles (file://
+ * feeds) are read straight from disk.
+ */
 typedef struct {
-  char *URL;
   char *title;
-  int freq;
-} Article;
+  char *URL;
+  int articleID;
+  bool isLocal;
+} ArticleJob;
+
+struct rssDatabase;
+
+/*
+ * Counters and timers kept by each indexer while it works, summed over
+ * all of them once the indices are built (see WriteStats).  Each indexer
+ * only updates its own, so they need no locking.  Times are in seconds.
+ * Fetch latencies are counted in power-of-two buckets: bucket i < the last
+ * counts the fetches that took less than 2^i milliseconds (and no less than
+ * 2^(i-1)); the last bucket counts everything slower.
+ */
+#define NUM_LATENCY_BUCKETS 12
+typedef struct {
+  int articlesFetched;
+  int fetchFailures;
+  int articlesRead;              // local (file://) articles
+  int articlesFromCache;
+  long long bytesFetched;
+  long long bytesRead;
+  double fetchTime;
+  double cdataTime;
+  double tokenizeTime;
+  double insertTime;
+  int fetchLatencies[NUM_LATENCY_BUCKETS];
+} indexStats;
+
+/*
+ * State of one indexer thread.
+ */
+typedef struct {
+  struct rssDatabase *db;
+  int indexerNum;
+  pthread_t thread;
+  indexStats stats;
+} indexer;
+
+/*
+ * The contents of an article, downloaded or read into memory.
+ * data is always '\0'-terminated.
+ */
+typedef struct {
+  char *data;
+  long length;
+  long allocatedLength;
+} pageBuffer;
+
+/*
+ * What the server said about a fetched document besides its body: the
+ * status code (0 for non-HTTP URLs) and the cache validators, which are
+ * empty if the server didn't send them.
+ */
+typedef struct {
+  long responseCode;
+  char etag[256];
+  char lastModified[128];
+} fetchInfo;
+
+typedef struct rssDatabase {
+  stopwords stopWords;
+  indexShard shards[NUM_INDEX_SHARDS];
+  vector articles;
+  hashset articlesByURL;
+  hashset articlesByTitle;
+  long totalTerms;
+  pthread_mutex_t articlesLock;   // guards the article table and totalTerms
+
+  int numIndexers;
+  indexer *indexers;
+  vector pendingArticles;         // queue of ArticleJob for the indexer threads
+  int nextPendingArticle;
+  bool doneQueueing;
+  pthread_mutex_t queueLock;
+  pthread_cond_t queueChanged;
+  bool benchmark;
+
+  bool useCache;                  // set with -c: articles unchanged since the last crawl
+  crawlcache cache;               // are indexed from the cache instead of being rescanned
+  const char *statsFileName;      // set with -s: where to write the stats, "-" for stdout
+} rssDatabase;
 
 static void Welcome(const char *welcomeTextFileName);
-static void BuildIndices(const char *feedsFileName, hashset *stopWords, hashset *map);
-static void ProcessFeed(const char *remoteDocumentName, hashset *stopWords, hashset *map);
-static void PullAllNewsItems(urlconnection *urlconn, hashset *stopWords, hashset *map);
+static void BuildIndices(const char *feedsFileName, rssDatabase *db);
+static void ProcessFeed(const char *remoteDocumentName, rssDatabase *db);
+static void PullAllNewsItems(urlconnection *urlconn, rssDatabase *db);
 static bool GetNextItemTag(streamtokenizer *st);
-static void ProcessSingleNewsItem(streamtokenizer *st, hashset *stopWords, hashset *map);
+static void ProcessSingleNewsItem(streamtokenizer *st, rssDatabase *db);
 static void ExtractElement(streamtokenizer *st, const char *htmlTag, char dataBuffer[], int bufferLength);
 static void ParseArticle(const char *articleTitle, const char *articleDescription, const char *articleURL, 
-                         hashset *stopWords, hashset *map);
-static void ScanArticle(streamtokenizer *st, const char *articleTitle, const char *unused, const char *articleURL, 
-                        hashset *stopWords, hashset *map);
-static void QueryIndices(hashset *stopWords, hashset *map);
-static void ProcessResponse(const char *word, hashset *stopWords, hashset *map);
+                         rssDatabase *db);
+static void QueueArticle(const char *articleTitle, const char *articleURL, bool isLocal, rssDatabase *db);
+static void IndexArticle(const ArticleJob *job, indexer *idx);
+static void RecordArticle(const char *URL, const cachedPage *notModified, const fetchInfo *info,
+                          uint64_t bodyHash, int numWords, const char *longestWord, hashset *counts,
+                          pageStatus status, rssDatabase *db);
+static int ScanArticle(const char *text, long length, bool skipMarkup, hashset *counts, rssDatabase *db,
+                       char longestWord[]);
+static void QueryIndices(rssDatabase *db);
+static void ProcessResponse(const char *response, rssDatabase *db);
 static bool WordIsWellFormed(const char *word);
+static void *IndexerThread(void *arg);
+static void InitCharClasses(void);
+static void CountWord(char *word, int count, hashset *counts, rssDatabase *db);
+static void MergeArticleCounts(hashset *counts, int articleID, rssDatabase *db);
+static int PostingLowerBound(const vector *postings, int start, int articleID);
+static double CurrentTime(void);
+static void RecordFetch(indexStats *stats, double latency, bool fetched, long length);
+static void WriteStats(const indexer indexers[], double buildTime, rssDatabase *db);
 
 
 static int StringHash(const void *s, int numBuckets);
 void StringFree(void *string);
 int StringCmp(const void *s1, const void *s2);
-void getStopWords(const char *stopWordsfile, hashset* stopWords);
 void MapFree(void *pair);
-void VectorFree(void *data);
-int VectorCmp(const void *a1, const void *a2);
-void updateData(char *word, const char *articleTitle, const char *articleURL, hashset *stopWords, hashset *map);
+void ArticleFree(void *data);
+int PostingCmp(const void *p1, const void *p2);
+int RegisterArticle(const char *articleTitle, const char *articleURL, rssDatabase *db);
+void updateData(char *word, int count, int articleID, hashset *indices);
 
 
 /**
@@ -77,29 +235,75 @@ static const char *const kFilePrefix = "file://";
 static const char *const kTextDelimiters = " \t\n\r\b!@$%^*()_+={[}]|\\'\":;/?.>,<~`";
 
 int main(int argc, char **argv) {
+  rssDatabase db;
+  int opt;
+
+  db.numIndexers = 1;
+  db.benchmark = false;
+  db.useCache = false;
+  db.statsFileName = NULL;
+  while ((opt = getopt(argc, argv, "j:bc:s:")) != -1) {
+    switch (opt) {
+    case 'j':
+      db.numIndexers = atoi(optarg);
+      break;
+    case 'b':
+      db.benchmark = true;
+      break;
+    case 'c':
+      db.useCache = true;
+      CrawlCacheNew(&db.cache, optarg);
+      break;
+    case 's':
+      db.statsFileName = optarg;
+      break;
+    default:
+      db.numIndexers = 0;
+    }
+  }
+  if (db.numIndexers < 1 || db.numIndexers > MAX_INDEXERS || argc - optind > 1) {
+    fprintf(stderr, "Usage: %s [-j <indexer threads, 1-%d>] [-b] [-c <crawl cache file>] [-s <stats file>] "
+            "[<feeds file>]\n", argv[0], MAX_INDEXERS);
+    return 1;
+  }
+
   setbuf(stdout, NULL);
   curl_global_init(CURL_GLOBAL_DEFAULT);
+  InitCharClasses();
   Welcome(kWelcomeTextFile);
-
-  hashset stopWords;
   
-  HashSetNew(&stopWords, sizeof(char *), NUM_BUCKETS_STOP, StringHash, StringCmp, StringFree);
-  getStopWords(kStopWords, &stopWords);
+  StopWordsNew(&db.stopWords, kStopWords);
 
   /*
-   * The map holds pairs of words and vectors.
+   * Each indices hashset holds pairs of words and vectors.
    * The word is like a key and the vector is like a value of a standart map
-   * The vector holds pairs of articles and and integers.
+   * The vector holds postings: the id of an article and an integer.
    * The integer tells us how many times the word is used in the artcle.
+   * The articles themselves live in db.articles, the id is their position there.
    */
-  hashset map;
-  HashSetNew(&map, sizeof(MapPair), NUM_BUCKETS_DATA, StringHash, StringCmp, MapFree);
-
-  BuildIndices((argc == 1) ? kDefaultFeedsFile : argv[1], &stopWords, &map);
-  QueryIndices(&stopWords, &map);
+  for (int s = 0; s < NUM_INDEX_SHARDS; s++) {
+    HashSetNew(&db.shards[s].indices, sizeof(MapPair), NUM_BUCKETS_SHARD, StringHash, StringCmp, MapFree);
+    pthread_mutex_init(&db.shards[s].lock, NULL);
+  }
+  VectorNew(&db.articles, sizeof(Article), ArticleFree, 64);
+  HashSetNew(&db.articlesByURL, sizeof(ArticleKey), NUM_BUCKETS_ARTICLES, StringHash, StringCmp, NULL);
+  HashSetNew(&db.articlesByTitle, sizeof(ArticleKey), NUM_BUCKETS_ARTICLES, StringHash, StringCmp, NULL);
+  db.totalTerms = 0;
+  pthread_mutex_init(&db.articlesLock, NULL);
+
+  BuildIndices((optind == argc) ? kDefaultFeedsFile : argv[optind], &db);
+  QueryIndices(&db);
   
-  HashSetDispose(&stopWords);
-  HashSetDispose(&map);
+  StopWordsDispose(&db.stopWords);
+  for (int s = 0; s < NUM_INDEX_SHARDS; s++) {
+    HashSetDispose(&db.shards[s].indices);
+    pthread_mutex_destroy(&db.shards[s].lock);
+  }
+  HashSetDispose(&db.articlesByURL);
+  HashSetDispose(&db.articlesByTitle);
+  VectorDispose(&db.articles);
+  pthread_mutex_destroy(&db.articlesLock);
+  if (db.useCache) CrawlCacheDispose(&db.cache);
   curl_global_cleanup();
   return 0;
 }
@@ -160,79 +364,187 @@ void MapFree(void *pair) {
 }
 
 /*
- * Function : VectorFree
- * ------------------
- * Frees the memory for the Vector
+ * Function : ArticleFree
+ * ----------------------
+ * Frees the memory for an Article of the article table
  */
-void VectorFree(void *data) {
+void ArticleFree(void *data) {
   Article *article = data;
   free(article->title);
   free(article->URL);
+  free(article->serverName);
 }
 
 /*
- * Function: VectorCmp
- * -------------------
- * Compairs the pairs stored in a vector of a map
- * based on the integer value inside.
- * Outputs is a reverse of standart int compear:
- * if a > b output is -1, so the vector sorts in a 
- * descending order.
+ * Function: PostingCmp
+ * --------------------
+ * Compares two postings by their article id, the order
+ * in which every postings vector is kept.
  */
-int VectorCmp(const void *a1, const void *a2) {
-  int a = ((Article *)a1)->freq;
-  int b = ((Article *)a2)->freq;
-  return (a > b) ? -1 : (a < b);
+int PostingCmp(const void *p1, const void *p2) {
+  int a = ((Posting *)p1)->articleID;
+  int b = ((Posting *)p2)->articleID;
+  return (a > b) - (a < b);
 }
 
+/*
+ * Function: CurrentTime
+ * ---------------------
+ * Returns a monotonic timestamp in seconds, for timing the index build.
+ */
+static double CurrentTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Function: SavePage
+ * ------------------
+ * curl write callback: appends the downloaded chunk to the pageBuffer,
+ * doubling its allocation as needed.
+ */
 size_t SavePage(char *ptr, size_t size, size_t nmemb, void *data) {
-  return fprintf((FILE *)data, "%s", ptr);
-}
-
-static FILE *RemoveCData(const char *tmpFile) {
-  FILE *inp = fopen(tmpFile, "rb");
-  fseek(inp, 0, SEEK_END);
-  long fsize = ftell(inp);
-  fseek(inp, 0, SEEK_SET); /* same as rewind(f); */
-  char *contents = malloc(fsize + 1);
-  long read = fread(contents, 1, fsize, inp);
-  assert(fsize == read);
-  fclose(inp);
-  FILE *out = fopen(tmpFile, "w");
+  pageBuffer *page = data;
+  long chunk = size * nmemb;
+  if (page->length + chunk + 1 > page->allocatedLength) {
+    while (page->length + chunk + 1 > page->allocatedLength)
+      page->allocatedLength *= 2;
+    page->data = realloc(page->data, page->allocatedLength);
+    assert(page->data != NULL);
+  }
+  memcpy(page->data + page->length, ptr, chunk);
+  page->length += chunk;
+  page->data[page->length] = '\0';
+  return chunk;
+}
+
+/*
+ * Function: RemoveCData
+ * ---------------------
+ * Strips the <![CDATA[ and ]]> markers out of the page in place,
+ * keeping the text between them.
+ */
+static void RemoveCData(pageBuffer *page) {
+  static const char kCDataStart[] = "<![CDATA[";
+  const long startLength = strlen(kCDataStart);
+  char *contents = page->data;
+  long fsize = page->length, out = 0;
   bool inside_cdata = false;
-  for (int i = 0; i < fsize; ++i) {
-    if (strncasecmp(contents + i, "<![CDATA[", strlen("<![CDATA[")) == 0) {
+  for (long i = 0; i < fsize; ++i) {
+    if (contents[i] == '<' && strncasecmp(contents + i, kCDataStart, startLength) == 0) {
       inside_cdata = true;
-      i += strlen("<![CDATA[") - 1;
-    } else if (inside_cdata && strncmp(contents + i, "]]>", 3) == 0) {
+      i += startLength - 1;
+    } else if (inside_cdata && contents[i] == ']' && strncmp(contents + i, "]]>", 3) == 0) {
       inside_cdata = false;
       i += 2;
     } else {
-      fprintf(out, "%c", contents[i]);
+      contents[out++] = contents[i];
     }
   }
-  fclose(out);
-  free(contents);
-  return fopen(tmpFile, "r");
+  contents[out] = '\0';
+  page->length = out;
+}
+
+static const long kInitialPageLength = 64 * 1024;
+
+static void PageNew(pageBuffer *page) {
+  page->allocatedLength = kInitialPageLength;
+  page->data = malloc(page->allocatedLength);
+  assert(page->data != NULL);
+  page->data[0] = '\0';
+  page->length = 0;
 }
 
-static FILE *FetchURL(const char *path, const char *tmpFile) {
-  FILE *tmpDoc = fopen(tmpFile, "w");
+/*
+ * Function: SaveHeaderValue
+ * -------------------------
+ * If the header line is the named header, copies its value, without
+ * surrounding whitespace, into value.
+ */
+static void SaveHeaderValue(const char *header, long length, const char *name, char value[], int valueLength) {
+  long nameLength = strlen(name);
+  if (length <= nameLength || strncasecmp(header, name, nameLength) != 0 || header[nameLength] != ':') return;
+  long start = nameLength + 1, end = length;
+  while (start < end && isspace((unsigned char)header[start])) start++;
+  while (end > start && isspace((unsigned char)header[end - 1])) end--;
+  if (end - start >= valueLength) return;
+  memcpy(value, header + start, end - start);
+  value[end - start] = '\0';
+}
+
+/*
+ * Function: SaveHeader
+ * --------------------
+ * curl header callback: picks the ETag and Last-Modified headers out of
+ * the response.  Every status line starts a new response (curl reports the
+ * headers of each redirect as well), so it clears what was saved so far.
+ */
+size_t SaveHeader(char *buffer, size_t size, size_t nitems, void *data) {
+  fetchInfo *info = data;
+  long length = size * nitems;
+  if (length >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    info->etag[0] = '\0';
+    info->lastModified[0] = '\0';
+  }
+  SaveHeaderValue(buffer, length, "ETag", info->etag, sizeof(info->etag));
+  SaveHeaderValue(buffer, length, "Last-Modified", info->lastModified, sizeof(info->lastModified));
+  return length;
+}
+
+/*
+ * Function: FetchURL
+ * ------------------
+ * Downloads the document at path straight into the page buffer.  If a
+ * cached copy is passed, the request is made conditional on the validators
+ * saved with it, and a server that still has the same document answers
+ * 304 with an empty body.  Returns false if the download failed.
+ */
+static bool FetchURL(const char *path, const cachedPage *cached, pageBuffer *page, fetchInfo *info) {
   CURL *curl;
   CURLcode res;
+  struct curl_slist *headers = NULL;
+  char header[512];
+
+  memset(info, 0, sizeof(fetchInfo));
+  if (cached != NULL && cached->etag[0] != '\0') {
+    snprintf(header, sizeof(header), "If-None-Match: %s", cached->etag);
+    headers = curl_slist_append(headers, header);
+  }
+  if (cached != NULL && cached->lastModified[0] != '\0') {
+    snprintf(header, sizeof(header), "If-Modified-Since: %s", cached->lastModified);
+    headers = curl_slist_append(headers, header);
+  }
+
   curl = curl_easy_init();
   curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
   curl_easy_setopt(curl, CURLOPT_URL, path);
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, SavePage);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, tmpDoc);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, page);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, SaveHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, info);
+  if (headers != NULL) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
   res = curl_easy_perform(curl);
-  fclose(tmpDoc);
+  if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &info->responseCode);
   curl_easy_cleanup(curl);
-  if (res != CURLE_OK) {
-    return NULL;
-  }
-  return RemoveCData(tmpFile);
+  curl_slist_free_all(headers);
+  return res == CURLE_OK;
+}
+
+/*
+ * Function: ReadFile
+ * ------------------
+ * Reads a local article into the page buffer.
+ */
+static void ReadFile(const char *fileName, pageBuffer *page) {
+  char chunk[8192];
+  size_t read;
+  FILE *infile = fopen(fileName, "r");
+  assert(infile != NULL);
+  while ((read = fread(chunk, 1, sizeof(chunk), infile)) > 0)
+    SavePage(chunk, 1, read, page);
+  fclose(infile);
 }
 
 /**
@@ -266,29 +578,6 @@ static void Welcome(const char *welcomeTextFileName) {
   fclose(infile);
 }
 
-/*
- * Function: getStopWords
- * ----------------------
- * Loads stopWords from the stop Word file, into a hashset
- */
-void getStopWords(const char *stopWordsfile, hashset* stopWords) {
-  FILE *infile;
-  streamtokenizer st;
-  char buffer[1024];
-
-  infile = fopen(stopWordsfile, "r");
-  assert(infile != NULL);
-
-  STNew(&st, infile, kNewLineDelimiters, true);
-  while(STNextToken(&st, buffer, sizeof(buffer))) {
-    char *cpy = strdup(buffer);
-    HashSetEnter(stopWords, &cpy);
-  }
-
-  STDispose(&st);
-  fclose(infile);
-}
-
 /**
  * Function: BuildIndices
  * ----------------------
@@ -302,13 +591,33 @@ void getStopWords(const char *stopWordsfile, hashset* stopWords) {
  * Each iteration of the supplied while loop parses and discards the feed name
  * (it's in the file for humans to read, but our aggregator doesn't care what
  * the name is) and then extracts the URL.  It then relies on ProcessFeed to
- * pull the remote document and index its content.
+ * pull the remote document and queue its articles.
+ *
+ * With more than one indexer, the articles are fetched and indexed by a pool
+ * of indexer threads while this thread keeps reading feeds; BuildIndices
+ * returns once every queued article has been indexed.
  */
 
-static void BuildIndices(const char *feedsFileName, hashset *stopWords, hashset *map) {
+static void BuildIndices(const char *feedsFileName, rssDatabase *db) {
   FILE *infile;
   streamtokenizer st;
   char remoteFileName[1024];
+  indexer indexers[MAX_INDEXERS];
+  double startTime = CurrentTime();
+
+  db->indexers = indexers;
+  VectorNew(&db->pendingArticles, sizeof(ArticleJob), NULL, 64);
+  db->nextPendingArticle = 0;
+  db->doneQueueing = false;
+  pthread_mutex_init(&db->queueLock, NULL);
+  pthread_cond_init(&db->queueChanged, NULL);
+  for (int i = 0; i < db->numIndexers; i++) {
+    indexers[i].db = db;
+    indexers[i].indexerNum = i;
+    memset(&indexers[i].stats, 0, sizeof(indexStats));
+    if (db->numIndexers > 1)
+      pthread_create(&indexers[i].thread, NULL, IndexerThread, &indexers[i]);
+  }
 
   infile = fopen(feedsFileName, "r");
   assert(infile != NULL);
@@ -316,28 +625,103 @@ static void BuildIndices(const char *feedsFileName, hashset *stopWords, hashset
   while (STSkipUntil(&st, ":") != EOF) { // ignore everything up to the first selicolon of the line
     STSkipOver( &st, ": "); // now ignore the semicolon and any whitespace directly after it
     STNextToken(&st, remoteFileName, sizeof(remoteFileName));
-    ProcessFeed(remoteFileName, stopWords, map);
+    ProcessFeed(remoteFileName, db);
   }
 
   STDispose(&st);
   fclose(infile);
+
+  pthread_mutex_lock(&db->queueLock);
+  db->doneQueueing = true;
+  pthread_cond_broadcast(&db->queueChanged);
+  pthread_mutex_unlock(&db->queueLock);
+  if (db->numIndexers > 1)
+    for (int i = 0; i < db->numIndexers; i++)
+      pthread_join(indexers[i].thread, NULL);
+  VectorDispose(&db->pendingArticles);
+  pthread_mutex_destroy(&db->queueLock);
+  pthread_cond_destroy(&db->queueChanged);
+  db->indexers = NULL;
   printf("\n");
+
+  if (db->benchmark) {
+    double elapsed = CurrentTime() - startTime;
+    int numArticles = VectorLength(&db->articles);
+    printf("Indexed %d articles in %.3f seconds (%.1f articles/sec) with %d indexer thread%s.\n",
+           numArticles, elapsed, numArticles / elapsed, db->numIndexers, db->numIndexers == 1 ? "" : "s");
+  }
+
+  if (db->useCache) {
+    int notModified = CrawlCacheCount(&db->cache, PageNotModified);
+    int sameContent = CrawlCacheCount(&db->cache, PageSameContent);
+    int changed = CrawlCacheCount(&db->cache, PageChanged);
+    printf("Crawl cache: %d of %d articles unchanged since the last crawl (%d not modified, %d with the same content).\n",
+           notModified + sameContent, notModified + sameContent + changed, notModified, sameContent);
+    if (!CrawlCacheSave(&db->cache))
+      printf("Unable to save the crawl cache to \"%s\".\n", db->cache.fileName);
+  }
+  if (db->statsFileName != NULL)
+    WriteStats(indexers, CurrentTime() - startTime, db);
+}
+
+/*
+ * Function: QueueArticle
+ * ----------------------
+ * Registers the article and hands it to the indexers.  With a single
+ * indexer the article is indexed right away on the calling thread, which
+ * keeps the output in feed order.
+ */
+static void QueueArticle(const char *articleTitle, const char *articleURL, bool isLocal, rssDatabase *db) {
+  ArticleJob job;
+  job.articleID = RegisterArticle(articleTitle, articleURL, db);
+  job.isLocal = isLocal;
+  if (db->numIndexers == 1) {
+    job.title = (char *)articleTitle;
+    job.URL = (char *)articleURL;
+    IndexArticle(&job, &db->indexers[0]);
+    return;
+  }
+
+  job.title = strdup(articleTitle);
+  job.URL = strdup(articleURL);
+  pthread_mutex_lock(&db->queueLock);
+  VectorAppend(&db->pendingArticles, &job);
+  pthread_cond_signal(&db->queueChanged);
+  pthread_mutex_unlock(&db->queueLock);
+}
+
+/*
+ * Function: IndexerThread
+ * -----------------------
+ * Body of each indexer thread: takes articles off the queue in order
+ * and indexes them until the queue is drained and no more are coming.
+ */
+static void *IndexerThread(void *arg) {
+  indexer *idx = arg;
+  rssDatabase *db = idx->db;
+  while (true) {
+    ArticleJob job;
+    pthread_mutex_lock(&db->queueLock);
+    while (db->nextPendingArticle == VectorLength(&db->pendingArticles) && !db->doneQueueing)
+      pthread_cond_wait(&db->queueChanged, &db->queueLock);
+    if (db->nextPendingArticle == VectorLength(&db->pendingArticles)) {
+      pthread_mutex_unlock(&db->queueLock);
+      return NULL;
+    }
+    job = *(ArticleJob *)VectorNth(&db->pendingArticles, db->nextPendingArticle++);
+    pthread_mutex_unlock(&db->queueLock);
+
+    IndexArticle(&job, idx);
+    free(job.title);
+    free(job.URL);
+  }
 }
 
 /** * Function: ProcessFeedFromFile * --------------------- * ProcessFeed
  * locates the specified RSS document, from locally */
 
-static void ProcessFeedFromFile(char *fileName, hashset *stopWords, hashset *map) {
-  FILE *infile;
-  streamtokenizer st;
-  char articleDescription[1024];
-  articleDescription[0] = '\0';
-  infile = fopen((const char *)fileName, "r");
-  assert(infile != NULL);
-  STNew(&st, infile, kTextDelimiters, true);
-  ScanArticle(&st, (const char *)fileName, articleDescription, (const char *)fileName, stopWords, map);
-  STDispose(&st); // remember that STDispose doesn't close the file, since STNew doesn't open one..
-  fclose(infile);
+static void ProcessFeedFromFile(char *fileName, rssDatabase *db) {
+  QueueArticle(fileName, fileName, true, db);
 }
 
 /**
@@ -351,10 +735,10 @@ static void ProcessFeedFromFile(char *fileName, hashset *stopWords, hashset *map
  * different response codes mean.
  */
 
-static void ProcessFeed(const char *remoteDocumentName, hashset *stopWords, hashset *map) {
+static void ProcessFeed(const char *remoteDocumentName, rssDatabase *db) {
 
   if (!strncmp(kFilePrefix, remoteDocumentName, strlen(kFilePrefix))) {
-    ProcessFeedFromFile((char *)remoteDocumentName + strlen(kFilePrefix), stopWords, map);
+    ProcessFeedFromFile((char *)remoteDocumentName + strlen(kFilePrefix), db);
     return;
   }
 
@@ -369,11 +753,11 @@ static void ProcessFeed(const char *remoteDocumentName, hashset *stopWords, hash
     printf("Unable to connect to \"%s\".  Ignoring...", u.serverName);
     break;
   case 200:
-    PullAllNewsItems(&urlconn, stopWords, map);
+    PullAllNewsItems(&urlconn, db);
     break;
   case 301:
   case 302:
-    ProcessFeed(urlconn.newUrl, stopWords, map);
+    ProcessFeed(urlconn.newUrl, db);
     break;
   default:
     printf(
@@ -419,12 +803,12 @@ static void ProcessFeed(const char *remoteDocumentName, hashset *stopWords, hash
  * </item>.
  */
 
-static void PullAllNewsItems(urlconnection *urlconn, hashset *stopWords, hashset *map) {
+static void PullAllNewsItems(urlconnection *urlconn, rssDatabase *db) {
   streamtokenizer st;
   STNew(&st, urlconn->dataStream, kTextDelimiters, false);
   while (GetNextItemTag(&st)) { // if true is returned, then assume that <item ...> has just been
                                 // read and pulled from the data stream
-    ProcessSingleNewsItem(&st, stopWords, map);
+    ProcessSingleNewsItem(&st, db);
   }
 
   STDispose(&st);
@@ -489,7 +873,7 @@ static const char *const kItemEndTag = "</item>";
 static const char *const kTitleTagPrefix = "<title";
 static const char *const kDescriptionTagPrefix = "<description";
 static const char *const kLinkTagPrefix = "<link";
-static void ProcessSingleNewsItem(streamtokenizer *st, hashset *stopWords, hashset *map){
+static void ProcessSingleNewsItem(streamtokenizer *st, rssDatabase *db){
   char htmlTag[1024];
   char articleTitle[1024];
   char articleDescription[1024];
@@ -510,7 +894,7 @@ static void ProcessSingleNewsItem(streamtokenizer *st, hashset *stopWords, hashs
 
   if (strncmp(articleURL, "", sizeof(articleURL)) == 0)
     return; // punt, since it's not going to take us anywhere
-  ParseArticle(articleTitle, articleDescription, articleURL, stopWords, map);
+  ParseArticle(articleTitle, articleDescription, articleURL, db);
 }
 
 /**
@@ -571,124 +955,593 @@ static void ExtractElement(streamtokenizer *st, const char *htmlTag,
  */
 
 static void ParseArticle(const char *articleTitle, const char *articleDescription, const char *articleURL, 
-                         hashset *stopWords, hashset *map) {
-  FILE *tmpDoc = FetchURL(articleURL, "tmp_doc");
-  if (tmpDoc == NULL) {
-    printf("Unable to fetch URL: %s\n", articleURL);
+                         rssDatabase *db) {
+  QueueArticle(articleTitle, articleURL, false, db);
+}
+
+/**
+ * Function: IndexArticle
+ * ----------------------
+ * Fetches the article (or reads it, if it's local) into memory, scans it,
+ * and adds its word counts to the indices.  The per-article summary is
+ * printed with a single printf so the output of concurrent indexers
+ * doesn't interleave.
+ *
+ * Local articles have always been read without skipping markup, so that is
+ * kept; remote articles have their HTML tags, comments, scripts and styles
+ * skipped.
+ *
+ * With the crawl cache on, a remote article the server reports as not
+ * modified, or sends again byte for byte, isn't scanned at all: its word
+ * counts come from the cache.
+ */
+
+static void IndexArticle(const ArticleJob *job, indexer *idx) {
+  rssDatabase *db = idx->db;
+  indexStats *stats = &idx->stats;
+  const cachedPage *cached = NULL;
+  fetchInfo info;
+  pageBuffer page;
+  PageNew(&page);
+  if (job->isLocal) {
+    ReadFile(job->URL, &page);
+    stats->articlesRead++;
+    stats->bytesRead += page.length;
+  } else {
+    if (db->useCache) cached = CrawlCacheLookup(&db->cache, job->URL);
+    double start = CurrentTime();
+    bool fetched = FetchURL(job->URL, cached, &page, &info);
+    RecordFetch(stats, CurrentTime() - start, fetched, page.length);
+    if (!fetched) {
+      printf("Unable to fetch URL: %s\n", job->URL);
+      free(page.data);
+      return;
+    }
+  }
+
+  pageStatus status = PageChanged;
+  uint64_t bodyHash = 0;
+  if (cached != NULL && info.responseCode == 304) {
+    status = PageNotModified;
+    bodyHash = cached->bodyHash;
+  } else if (db->useCache && !job->isLocal) {
+    bodyHash = CrawlCacheHash(page.data, page.length);
+    if (cached != NULL && bodyHash == cached->bodyHash) status = PageSameContent;
+  }
+
+  hashset counts;
+  char longestWord[1024] = {'\0'};
+  int numWords;
+  HashSetNew(&counts, sizeof(WordCount), NUM_BUCKETS_ARTICLE_TERMS, StringHash, StringCmp, StringFree);
+  double start = CurrentTime();
+  if (status == PageChanged) {
+    if (!job->isLocal) {
+      RemoveCData(&page);
+      double stripped = CurrentTime();
+      stats->cdataTime += stripped - start;
+      start = stripped;
+    }
+    numWords = ScanArticle(page.data, page.length, !job->isLocal, &counts, db, longestWord);
+    stats->tokenizeTime += CurrentTime() - start;
+  } else {
+    stats->articlesFromCache++;
+    numWords = cached->numWords;
+    snprintf(longestWord, sizeof(longestWord), "%s", cached->longestWord);
+    for (int i = 0; i < VectorLength(&cached->terms); i++) {
+      const cachedTerm *term = VectorNth(&cached->terms, i);
+      CountWord(term->word, term->count, &counts, db);
+    }
+  }
+  free(page.data);
+  start = CurrentTime();
+  MergeArticleCounts(&counts, job->articleID, db);
+  stats->insertTime += CurrentTime() - start;
+  if (db->useCache && !job->isLocal)
+    RecordArticle(job->URL, status == PageNotModified ? cached : NULL, &info, bodyHash, numWords,
+                  longestWord, &counts, status, db);
+  HashSetDispose(&counts);
+
+  char summary[2560];
+  int length = 0;
+  if (!job->isLocal)
+    length += snprintf(summary + length, sizeof(summary) - length, "Scanning \"%s\"\n", job->URL);
+  if (status != PageChanged)
+    length += snprintf(summary + length, sizeof(summary) - length, "\tUnchanged since the last crawl [%s].\n",
+                       status == PageNotModified ? "not modified" : "same content");
+  length += snprintf(summary + length, sizeof(summary) - length,
+                     "\tWe counted %d well-formed words [including duplicates].\n"
+                     "\tThe longest word scanned was \"%s\".%s\n", numWords, longestWord,
+                     (strlen(longestWord) >= 15 && (strchr(longestWord, '-') == NULL)) ? " [Ooooo... long word!]" : "");
+  printf("%s", summary);
+}
+
+static void CollectCachedTerm(void *elemAddr, void *auxData) {
+  WordCount *wordCount = elemAddr;
+  cachedTerm term = { wordCount->word, wordCount->count };
+  VectorAppend((vector *)auxData, &term);
+}
+
+/*
+ * Function: RecordArticle
+ * -----------------------
+ * Saves the article's word counts in the crawl cache, along with the
+ * validators the server sent.  A 304 response may leave a validator out,
+ * in which case the one already cached for it still holds.
+ */
+static void RecordArticle(const char *URL, const cachedPage *notModified, const fetchInfo *info,
+                          uint64_t bodyHash, int numWords, const char *longestWord, hashset *counts,
+                          pageStatus status, rssDatabase *db) {
+  const char *etag = info->etag, *lastModified = info->lastModified;
+  if (notModified != NULL && etag[0] == '\0') etag = notModified->etag;
+  if (notModified != NULL && lastModified[0] == '\0') lastModified = notModified->lastModified;
+
+  vector terms;
+  VectorNew(&terms, sizeof(cachedTerm), NULL, HashSetCount(counts) + 1);
+  HashSetMap(counts, CollectCachedTerm, &terms);
+  CrawlCacheRecord(&db->cache, URL, etag, lastModified, bodyHash, numWords, longestWord, &terms, status);
+  VectorDispose(&terms);
+}
+
+/*
+ * Function: RecordFetch
+ * ---------------------
+ * Counts one download, successful or not, in the indexer's stats.
+ */
+static void RecordFetch(indexStats *stats, double latency, bool fetched, long length) {
+  double ms = latency * 1000;
+  int bucket = 0;
+  while (bucket < NUM_LATENCY_BUCKETS - 1 && ms >= (1 << bucket)) bucket++;
+  stats->fetchLatencies[bucket]++;
+  stats->fetchTime += latency;
+  if (!fetched) {
+    stats->fetchFailures++;
     return;
   }
-  printf("Scanning \"%s\"\n", articleURL);
-  streamtokenizer st;
-  STNew(&st, tmpDoc, kTextDelimiters, false);
-  ScanArticle(&st, articleTitle, articleDescription, articleURL, stopWords, map);
-  STDispose(&st);
-  fclose(tmpDoc);
+  stats->articlesFetched++;
+  stats->bytesFetched += length;
+}
+
+/*
+ * Size of the indices, as measured by MeasureIndexEntry.  memory is an
+ * estimate of the bytes held by the shards: their bucket vectors, the
+ * entries, the words and the postings, without the unused room at the
+ * end of each vector or the allocator's own overhead.
+ */
+typedef struct {
+  long numTerms;
+  long numPostings;
+  long long memory;
+} indexSize;
+
+static void MeasureIndexEntry(void *elemAddr, void *auxData) {
+  MapPair *pair = elemAddr;
+  indexSize *size = auxData;
+  int numPostings = VectorLength(pair->second);
+  size->numTerms++;
+  size->numPostings += numPostings;
+  size->memory += sizeof(MapPair) + strlen(pair->first) + 1 + sizeof(vector) + numPostings * sizeof(Posting);
+}
+
+/*
+ * Function: WriteStats
+ * --------------------
+ * Sums the stats of all indexers, measures the indices, and writes
+ * everything as a single JSON object to db->statsFileName (or stdout,
+ * if that's "-").  The times are summed over all indexer threads, so with
+ * several threads they can add up to more than buildTime, the wall clock
+ * time taken to build the indices.
+ */
+static void WriteStats(const indexer indexers[], double buildTime, rssDatabase *db) {
+  indexStats total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < db->numIndexers; i++) {
+    const indexStats *stats = &indexers[i].stats;
+    total.articlesFetched += stats->articlesFetched;
+    total.fetchFailures += stats->fetchFailures;
+    total.articlesRead += stats->articlesRead;
+    total.articlesFromCache += stats->articlesFromCache;
+    total.bytesFetched += stats->bytesFetched;
+    total.bytesRead += stats->bytesRead;
+    total.fetchTime += stats->fetchTime;
+    total.cdataTime += stats->cdataTime;
+    total.tokenizeTime += stats->tokenizeTime;
+    total.insertTime += stats->insertTime;
+    for (int b = 0; b < NUM_LATENCY_BUCKETS; b++)
+      total.fetchLatencies[b] += stats->fetchLatencies[b];
+  }
+
+  indexSize size = { 0, 0, (long long)NUM_INDEX_SHARDS * NUM_BUCKETS_SHARD * sizeof(vector) };
+  for (int s = 0; s < NUM_INDEX_SHARDS; s++)
+    HashSetMap(&db->shards[s].indices, MeasureIndexEntry, &size);
+
+  bool toStdout = strcmp(db->statsFileName, "-") == 0;
+  FILE *outfile = toStdout ? stdout : fopen(db->statsFileName, "w");
+  if (outfile == NULL) {
+    printf("Unable to write the stats to \"%s\".\n", db->statsFileName);
+    return;
+  }
+  fprintf(outfile, "{\n");
+  fprintf(outfile, "  \"indexer_threads\": %d,\n", db->numIndexers);
+  fprintf(outfile, "  \"build_seconds\": %.6f,\n", buildTime);
+  fprintf(outfile, "  \"articles\": %d,\n", VectorLength(&db->articles));
+  fprintf(outfile, "  \"fetch\": {\n");
+  fprintf(outfile, "    \"articles\": %d,\n", total.articlesFetched);
+  fprintf(outfile, "    \"failures\": %d,\n", total.fetchFailures);
+  fprintf(outfile, "    \"bytes\": %lld,\n", total.bytesFetched);
+  fprintf(outfile, "    \"seconds\": %.6f,\n", total.fetchTime);
+  fprintf(outfile, "    \"latency_ms_histogram\": [");
+  for (int b = 0; b < NUM_LATENCY_BUCKETS; b++) {
+    if (b < NUM_LATENCY_BUCKETS - 1)
+      fprintf(outfile, "{\"below_ms\": %d, \"count\": %d}, ", 1 << b, total.fetchLatencies[b]);
+    else
+      fprintf(outfile, "{\"below_ms\": null, \"count\": %d}]\n", total.fetchLatencies[b]);
+  }
+  fprintf(outfile, "  },\n");
+  fprintf(outfile, "  \"local\": {\"articles\": %d, \"bytes\": %lld},\n", total.articlesRead, total.bytesRead);
+  fprintf(outfile, "  \"from_crawl_cache\": %d,\n", total.articlesFromCache);
+  fprintf(outfile, "  \"seconds\": {\"cdata_strip\": %.6f, \"tokenize\": %.6f, \"index_insert\": %.6f},\n",
+          total.cdataTime, total.tokenizeTime, total.insertTime);
+  fprintf(outfile, "  \"index\": {\"distinct_terms\": %ld, \"postings\": %ld, \"term_occurrences\": %ld, "
+          "\"memory_bytes\": %lld}\n", size.numTerms, size.numPostings, db->totalTerms, size.memory);
+  fprintf(outfile, "}\n");
+  if (!toStdout) fclose(outfile);
+}
+
+/*
+ * Character classes for the article scanner and WordIsWellFormed, built
+ * once from kTextDelimiters and the C locale so that classifying a byte
+ * is a single table lookup.
+ */
+#define CHAR_DELIMITER  0x1
+#define CHAR_WORD_START 0x2
+#define CHAR_WORD       0x4
+static unsigned char charClasses[256];
+
+static void InitCharClasses(void) {
+  for (int ch = 0; ch < 256; ch++) {
+    charClasses[ch] = 0;
+    if (ch != 0 && strchr(kTextDelimiters, ch) != NULL) charClasses[ch] |= CHAR_DELIMITER;
+    if (isalpha(ch)) charClasses[ch] |= CHAR_WORD_START;
+    if (isalnum(ch) || ch == '-') charClasses[ch] |= CHAR_WORD;
+  }
+}
+
+/*
+ * Function: FindCaseInsensitive
+ * -----------------------------
+ * Returns the position of the first occurrence of pattern in text at or
+ * after start, or length if there is none.
+ */
+static long FindCaseInsensitive(const char *text, long length, long start, const char *pattern) {
+  long patternLength = strlen(pattern);
+  int first = tolower((unsigned char)pattern[0]);
+  for (long i = start; i + patternLength <= length; i++)
+    if (tolower((unsigned char)text[i]) == first && strncasecmp(text + i, pattern, patternLength) == 0)
+      return i;
+  return length;
+}
+
+/*
+ * Function: SkipMarkup
+ * --------------------
+ * Given the position just past a '<', returns the position just past the
+ * markup it opens: through "-->" for a comment, through the closing
+ * </script> or </style> tag for scripts and styles (neither of which is
+ * text), and through the next '>' for any other tag.
+ */
+static long SkipMarkup(const char *text, long length, long pos) {
+  if (length - pos >= 3 && strncmp(text + pos, "!--", 3) == 0) {
+    long end = FindCaseInsensitive(text, length, pos + 3, "-->");
+    return (end == length) ? length : end + 3;
+  }
+
+  const char *closingTag = NULL;
+  if (length - pos >= 6 && strncasecmp(text + pos, "script", 6) == 0) closingTag = "</script";
+  else if (length - pos >= 5 && strncasecmp(text + pos, "style", 5) == 0) closingTag = "</style";
+
+  const char *tagEnd = memchr(text + pos, '>', length - pos);
+  if (tagEnd == NULL) return length;
+  pos = tagEnd - text + 1;
+  if (closingTag == NULL) return pos;
+
+  pos = FindCaseInsensitive(text, length, pos, closingTag);
+  tagEnd = memchr(text + pos, '>', length - pos);
+  return (tagEnd == NULL) ? length : tagEnd - text + 1;
+}
+
+/*
+ * Function: DecodeEntity
+ * ----------------------
+ * Decodes the HTML escape sequence that starts at the '&' of entity and
+ * runs for length bytes (';' is a delimiter, so the sequence always ends
+ * the token).  Returns the character it stands for, or '&' if it isn't one
+ * we know, which leaves the word malformed just like the '&' would.
+ */
+static char DecodeEntity(const char *entity, int length) {
+  static const struct { const char *name; char ch; } kEntities[] = {
+    { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' }, { "nbsp", ' ' }
+  };
+  const char *name = entity + 1;
+  int nameLength = length - 1;
+  if (nameLength > 1 && name[0] == '#') {
+    long code = (name[1] == 'x' || name[1] == 'X') ? strtol(name + 2, NULL, 16) : strtol(name + 1, NULL, 10);
+    return (code > 0 && code < 128) ? (char)code : '&';
+  }
+  for (int i = 0; i < sizeof(kEntities) / sizeof(kEntities[0]); i++)
+    if (strlen(kEntities[i].name) == nameLength && strncmp(name, kEntities[i].name, nameLength) == 0)
+      return kEntities[i].ch;
+  return '&';
+}
+
+/*
+ * Function: ExtractWord
+ * ---------------------
+ * Decodes the token of the given length into word and reports whether it
+ * is well-formed: a letter followed by letters, digits or '-'.  The
+ * lowercase form the word is indexed under is written to term.
+ */
+static bool ExtractWord(const char *token, int length, char word[], char term[], int bufferLength) {
+  int out = 0;
+  for (int i = 0; i < length; i++) {
+    char ch = token[i];
+    if (ch == '&') {
+      ch = DecodeEntity(token + i, length - i);
+      i = length;
+    }
+    int mask = (out == 0) ? CHAR_WORD_START : CHAR_WORD;
+    if (!(charClasses[(unsigned char)ch] & mask) || out == bufferLength - 1) return false;
+    word[out] = ch;
+    term[out] = tolower((unsigned char)ch);
+    out++;
+  }
+  word[out] = term[out] = '\0';
+  return out > 0;
 }
 
 /**
  * Function: ScanArticle
  * ---------------------
- * Parses the specified article, skipping over all HTML tags, and counts the
- * numbers of well-formed words that could potentially serve as keys in the set
- * of indices. Once the full article has been scanned, the number of well-formed
- * words is printed, and the longest well-formed word we encountered along the
- * way is printed as well.
- *
- * This is really a placeholder implementation for what will ultimately be
- * code that indexes the specified content.
+ * Scans the article text in a single pass, skipping over all HTML markup
+ * when skipMarkup is set, and counts the numbers of well-formed words that
+ * could potentially serve as keys in the set of indices.  Tokens are runs of
+ * bytes between kTextDelimiters; each byte is classified with one lookup in
+ * charClasses.  The words are counted in counts, a table local to this
+ * article, so that the shared indices are only touched once per distinct
+ * word when the caller merges it into the index shards.  Returns the number
+ * of well-formed words and fills longestWord with the longest one.
  */
 
-static void ScanArticle(streamtokenizer *st, const char *articleTitle, const char *unused, const char *articleURL, 
-                        hashset *stopWords, hashset *map) {
-  int numWords = 0;
-  char word[1024];
-  char longestWord[1024] = {'\0'};
-
-  while (STNextToken(st, word, sizeof(word))) {
-    if (strcasecmp(word, "<") == 0) {
-      SkipIrrelevantContent(st); // in html-utls.h
-    } else {
-      RemoveEscapeCharacters(word);
-      if (WordIsWellFormed(word)) {
-        updateData(word, articleTitle, articleURL, stopWords, map);
-        numWords++;
-        if (strlen(word) > strlen(longestWord))
-          strcpy(longestWord, word);
+static int ScanArticle(const char *text, long length, bool skipMarkup, hashset *counts, rssDatabase *db,
+                       char longestWord[]) {
+  int numWords = 0, longestLength = strlen(longestWord);
+  char word[1024], term[1024];
+
+  long pos = 0;
+  while (pos < length) {
+    unsigned char ch = text[pos];
+    if (charClasses[ch] & CHAR_DELIMITER) {
+      pos = (ch == '<' && skipMarkup) ? SkipMarkup(text, length, pos + 1) : pos + 1;
+      continue;
+    }
+    long start = pos;
+    while (pos < length && !(charClasses[(unsigned char)text[pos]] & CHAR_DELIMITER))
+      pos++;
+    if (ExtractWord(text + start, pos - start, word, term, sizeof(word))) {
+      CountWord(term, 1, counts, db);
+      numWords++;
+      int wordLength = strlen(word);
+      if (wordLength > longestLength) {
+        strcpy(longestWord, word);
+        longestLength = wordLength;
       }
     }
   }
 
-  printf("\tWe counted %d well-formed words [including duplicates].\n", numWords);
-  printf("\tThe longest word scanned was \"%s\".", longestWord);
-  if (strlen(longestWord) >= 15 && (strchr(longestWord, '-') == NULL))
-    printf(" [Ooooo... long word!]");
-  printf("\n");
+  return numWords;
+}
+
+/*
+ * Function: CountWord
+ * -------------------
+ * Counts count more occurrences of the (lowercase) word in the
+ * article-local table, unless it's a stop word.
+ */
+static void CountWord(char *word, int count, hashset *counts, rssDatabase *db) {
+  if (StopWordsContains(&db->stopWords, word)) return;
+  WordCount *found = HashSetLookup(counts, &word);
+  if (found != NULL) {
+    found->count += count;
+    return;
+  }
+  WordCount wordCount;
+  wordCount.word = strdup(word);
+  wordCount.count = count;
+  wordCount.shard = StringHash(&word, NUM_INDEX_SHARDS);
+  HashSetEnter(counts, &wordCount);
+}
+
+static void CollectWordCount(void *elemAddr, void *auxData) {
+  WordCount *wordCount = elemAddr;
+  VectorAppend((vector *)auxData, &wordCount);
+}
+
+static int WordCountShardCmp(const void *p1, const void *p2) {
+  int a = (*(WordCount **)p1)->shard;
+  int b = (*(WordCount **)p2)->shard;
+  return (a > b) - (a < b);
+}
+
+/*
+ * Function: MergeArticleCounts
+ * ----------------------------
+ * Adds the article's word counts to the indices.  The words are grouped by
+ * shard so that each shard lock is taken at most once per article.
+ */
+static void MergeArticleCounts(hashset *counts, int articleID, rssDatabase *db) {
+  vector byShard;
+  int numTerms = 0;
+
+  VectorNew(&byShard, sizeof(WordCount *), NULL, HashSetCount(counts) + 1);
+  HashSetMap(counts, CollectWordCount, &byShard);
+  VectorSort(&byShard, WordCountShardCmp);
+
+  for (int i = 0; i < VectorLength(&byShard); ) {
+    indexShard *shard = &db->shards[(*(WordCount **)VectorNth(&byShard, i))->shard];
+    pthread_mutex_lock(&shard->lock);
+    for (; i < VectorLength(&byShard); i++) {
+      WordCount *wordCount = *(WordCount **)VectorNth(&byShard, i);
+      if (&db->shards[wordCount->shard] != shard) break;
+      updateData(wordCount->word, wordCount->count, articleID, &shard->indices);
+      numTerms += wordCount->count;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  VectorDispose(&byShard);
+
+  pthread_mutex_lock(&db->articlesLock);
+  ((Article *)VectorNth(&db->articles, articleID))->numTerms += numTerms;
+  db->totalTerms += numTerms;
+  pthread_mutex_unlock(&db->articlesLock);
+}
+
+/*
+ * Function: RegisterArticle
+ * -------------------------
+ * Returns the id of the article with the given title and URL, adding
+ * it to the article table if we haven't seen it before.  An article is
+ * considered already seen if it has the same URL as a previous one, or
+ * the same title as one served from a different server (the same story
+ * syndicated by several feeds).
+ */
+int RegisterArticle(const char *articleTitle, const char *articleURL, rssDatabase *db) {
+  pthread_mutex_lock(&db->articlesLock);
+  ArticleKey key = { articleURL, -1 };
+  ArticleKey *found = HashSetLookup(&db->articlesByURL, &key);
+  if (found != NULL) {
+    pthread_mutex_unlock(&db->articlesLock);
+    return found->articleID;
+  }
+
+  url URL;
+  URLNewAbsolute(&URL, articleURL);
+  key.key = articleTitle;
+  found = HashSetLookup(&db->articlesByTitle, &key);
+  if (found != NULL) {
+    Article *seen = VectorNth(&db->articles, found->articleID);
+    if (strcasecmp(URL.serverName, seen->serverName)) {
+      URLDispose(&URL);
+      pthread_mutex_unlock(&db->articlesLock);
+      return found->articleID;
+    }
+  }
+
+  Article article;
+  article.URL = strdup(articleURL);
+  article.title = strdup(articleTitle);
+  article.serverName = strdup(URL.serverName);
+  article.numTerms = 0;
+  URLDispose(&URL);
+
+  int articleID = VectorLength(&db->articles);
+  VectorAppend(&db->articles, &article);
+
+  key.articleID = articleID;
+  key.key = article.URL;
+  HashSetEnter(&db->articlesByURL, &key);
+  key.key = article.title;
+  if (found == NULL) HashSetEnter(&db->articlesByTitle, &key);
+  pthread_mutex_unlock(&db->articlesLock);
+  return articleID;
+}
+
+/*
+ * Function: PostingLowerBound
+ * ---------------------------
+ * Returns the position of the first posting at or after start whose
+ * article id is not less than articleID, or the length of the vector if
+ * there is none.  The search gallops forward from start (1, 2, 4, ...
+ * postings) and then binary searches the last step, so walking a long
+ * postings vector with increasing targets only touches a few entries per
+ * target.
+ */
+static int PostingLowerBound(const vector *postings, int start, int articleID) {
+  int length = VectorLength(postings);
+  int low = start, high = start, step = 1;
+  while (high < length && ((Posting *)VectorNth(postings, high))->articleID < articleID) {
+    low = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > length) high = length;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (((Posting *)VectorNth(postings, mid))->articleID < articleID) low = mid + 1;
+    else high = mid;
+  }
+  return low;
 }
 
 /*
  * Function: updateData
  * --------------------
- * The function adds word-vector pairs to the map.
- * If the map doesn't contain new word, the function creates a new one.
- * If the map contains a word, then adds an inforamtion on a new article
- * or updates the frequency of an existing one.
+ * The function adds word-vector pairs to the indices.
+ * If the indices don't contain the word, the function creates a new one.
+ * If they contain it, then adds a posting for the article or updates the
+ * frequency of an existing one.  Articles are mostly merged in the order
+ * of their ids, so the posting we're after is almost always the last one;
+ * an article merged late (by a slower indexer, or seen again through another
+ * feed) is found with a binary search and keeps the vector sorted.
  */
-void updateData(char *word, const char *articleTitle, const char *articleURL, hashset *stopWords, hashset *map) {
-  if (HashSetLookup(stopWords, &word) != NULL) return;
-  void *data = HashSetLookup(map, &word);
-  vector *articles;
+void updateData(char *word, int count, int articleID, hashset *indices) {
+  MapPair *data = HashSetLookup(indices, &word);
+  Posting posting = { articleID, count };
 
   if (data == NULL) {
-    articles = malloc(sizeof(vector));
-    VectorNew(articles, sizeof(Article), VectorFree, 4);
-    Article article;
-    article.URL = strdup(articleURL);
-    article.title = strdup(articleTitle);
-    article.freq = 1; 
-    VectorAppend(articles, &article);
+    vector *postings = malloc(sizeof(vector));
+    VectorNew(postings, sizeof(Posting), NULL, 4);
+    VectorAppend(postings, &posting);
 
     MapPair info;
     info.first = strdup(word);
-    info.second = articles; 
-    HashSetEnter(map, &info);
+    info.second = postings; 
+    HashSetEnter(indices, &info);
     return;
   } 
-  articles = ((MapPair *)data)->second;
-  url URL, vectorURL;
-  URLNewAbsolute(&URL, articleURL);
 
-  for (int i = 0; i < VectorLength(articles); i++) {
-    Article *article = (Article *)VectorNth(articles, i);
-    URLNewAbsolute(&vectorURL, article->URL);
-    if (!strcasecmp(articleURL, article->URL) || 
-    (strcasecmp(URL.serverName, vectorURL.serverName) && !strcasecmp(articleTitle, article->title))) 
-    {
-      article->freq++;
-      URLDispose(&vectorURL);
-      URLDispose(&URL);
-      return;
-    }
-    URLDispose(&vectorURL);
+  vector *postings = data->second;
+  int length = VectorLength(postings);
+  Posting *last = VectorNth(postings, length - 1);
+  if (last->articleID == articleID) {
+    last->freq += count;
+  } else if (last->articleID < articleID) {
+    VectorAppend(postings, &posting);
+  } else {
+    int pos = PostingLowerBound(postings, 0, articleID);
+    Posting *existing = VectorNth(postings, pos);
+    if (existing->articleID == articleID) existing->freq += count;
+    else VectorInsert(postings, &posting, pos);
   }
+}
 
-  Article article;
-  article.URL = strdup(articleURL);
-  article.title = strdup(articleTitle);
-  article.freq = 1; 
-  VectorAppend(articles, &article);  
-
-  URLDispose(&URL);
+/*
+ * Function: LookupPostings
+ * ------------------------
+ * Returns the postings of the word, or NULL if no article contains it.
+ */
+static vector *LookupPostings(const char *word, rssDatabase *db) {
+  MapPair *info = HashSetLookup(&db->shards[StringHash(&word, NUM_INDEX_SHARDS)].indices, &word);
+  return (info == NULL) ? NULL : info->second;
 }
 
 /**
  * Function: QueryIndices
  * ----------------------
- * Standard query loop that allows the user to specify a single search term, and
- * then proceeds (via ProcessResponse) to list up to 10 articles (sorted by
- * relevance) that contain that word.
+ * Standard query loop that allows the user to specify one or more search terms,
+ * and then proceeds (via ProcessResponse) to list up to 10 articles (sorted by
+ * relevance) that match them.
  */
 
-static void QueryIndices(hashset *stopWords, hashset *map) {
+static void QueryIndices(rssDatabase *db) {
   char response[1024];
   while (true) {
     // printf("Please enter a single query term that might be in our set of indices [enter to quit]: ");
@@ -696,39 +1549,286 @@ static void QueryIndices(hashset *stopWords, hashset *map) {
     response[strlen(response) - 1] = '\0';
     if (strcasecmp(response, "") == 0)
       break;
-    ProcessResponse(response, stopWords, map);
+    ProcessResponse(response, db);
+  }
+}
+
+#define MAX_QUERY_TERMS 32
+#define MAX_RESULTS 10
+
+/*
+ * A query term together with its postings and the cursor
+ * used while walking them.
+ */
+typedef struct {
+  const char *word;
+  vector *postings;
+  int cursor;
+  double idf;
+} QueryTerm;
+
+typedef struct {
+  double score;
+  int articleID;
+  int freq;
+} QueryResult;
+
+/*
+ * Function: ResultIsWorse
+ * -----------------------
+ * Ordering used by the result heap: a lower score is worse, and between
+ * equal scores the later article is worse, so ties keep indexing order.
+ */
+static bool ResultIsWorse(const QueryResult *a, const QueryResult *b) {
+  if (a->score != b->score) return a->score < b->score;
+  return a->articleID > b->articleID;
+}
+
+static void ResultSiftDown(QueryResult heap[], int size, int i) {
+  while (true) {
+    int worst = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < size && ResultIsWorse(&heap[l], &heap[worst])) worst = l;
+    if (r < size && ResultIsWorse(&heap[r], &heap[worst])) worst = r;
+    if (worst == i) return;
+    QueryResult tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+/*
+ * Function: ResultOffer
+ * ---------------------
+ * Keeps the best MAX_RESULTS results seen so far in a min-heap whose root
+ * is the worst of them, so each candidate costs O(log k) instead of the
+ * full sort of every matching article.
+ */
+static void ResultOffer(QueryResult heap[], int *size, const QueryResult *candidate) {
+  if (*size < MAX_RESULTS) {
+    int i = (*size)++;
+    heap[i] = *candidate;
+    while (i > 0 && ResultIsWorse(&heap[i], &heap[(i - 1) / 2])) {
+      QueryResult tmp = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+  } else if (ResultIsWorse(&heap[0], candidate)) {
+    heap[0] = *candidate;
+    ResultSiftDown(heap, *size, 0);
+  }
+}
+
+/*
+ * Function: ResultSortHeap
+ * ------------------------
+ * Heap-sorts the results in place so the best one comes first.
+ */
+static void ResultSortHeap(QueryResult heap[], int size) {
+  for (int last = size - 1; last > 0; last--) {
+    QueryResult tmp = heap[0];
+    heap[0] = heap[last];
+    heap[last] = tmp;
+    ResultSiftDown(heap, last, 0);
+  }
+}
+
+/*
+ * Okapi BM25 parameters: kBM25K1 limits how much repeated occurrences
+ * of a term count, kBM25B how much long articles are penalized.
+ */
+static const double kBM25K1 = 1.2;
+static const double kBM25B = 0.75;
+
+static double TermScore(const QueryTerm *term, const Posting *posting, rssDatabase *db) {
+  Article *article = VectorNth(&db->articles, posting->articleID);
+  double averageLength = (double)db->totalTerms / VectorLength(&db->articles);
+  double norm = kBM25K1 * (1 - kBM25B + kBM25B * article->numTerms / averageLength);
+  return term->idf * posting->freq * (kBM25K1 + 1) / (posting->freq + norm);
+}
+
+/*
+ * Function: MatchAllTerms
+ * -----------------------
+ * Intersects the postings of all terms.  The terms are walked from the
+ * rarest one, and the others gallop forward to each candidate article, so
+ * the cost is driven by the shortest postings vector.
+ */
+static void MatchAllTerms(QueryTerm terms[], int numTerms, rssDatabase *db,
+                          QueryResult heap[], int *heapSize) {
+  for (int i = 1; i < numTerms; i++) {
+    QueryTerm key = terms[i];
+    int j = i - 1;
+    for (; j >= 0 && VectorLength(terms[j].postings) > VectorLength(key.postings); j--)
+      terms[j + 1] = terms[j];
+    terms[j + 1] = key;
+  }
+
+  vector *rarest = terms[0].postings;
+  for (int r = 0; r < VectorLength(rarest); r++) {
+    Posting *posting = VectorNth(rarest, r);
+    QueryResult result = { TermScore(&terms[0], posting, db), posting->articleID, posting->freq };
+    bool matches = true;
+    for (int i = 1; i < numTerms && matches; i++) {
+      terms[i].cursor = PostingLowerBound(terms[i].postings, terms[i].cursor, posting->articleID);
+      if (terms[i].cursor == VectorLength(terms[i].postings)) {
+        r = VectorLength(rarest); // nothing further can match all terms
+        matches = false;
+      } else {
+        Posting *other = VectorNth(terms[i].postings, terms[i].cursor);
+        matches = (other->articleID == posting->articleID);
+        if (matches) result.score += TermScore(&terms[i], other, db);
+      }
+    }
+    if (matches) ResultOffer(heap, heapSize, &result);
+  }
+}
+
+/*
+ * Function: MatchAnyTerm
+ * ----------------------
+ * Merges the postings of all terms, scoring every article that
+ * contains at least one of them.
+ */
+static void MatchAnyTerm(QueryTerm terms[], int numTerms, rssDatabase *db,
+                         QueryResult heap[], int *heapSize) {
+  while (true) {
+    int next = -1;
+    for (int i = 0; i < numTerms; i++) {
+      if (terms[i].cursor == VectorLength(terms[i].postings)) continue;
+      int id = ((Posting *)VectorNth(terms[i].postings, terms[i].cursor))->articleID;
+      if (next == -1 || id < next) next = id;
+    }
+    if (next == -1) return;
+
+    QueryResult result = { 0, next, 0 };
+    for (int i = 0; i < numTerms; i++) {
+      if (terms[i].cursor == VectorLength(terms[i].postings)) continue;
+      Posting *posting = VectorNth(terms[i].postings, terms[i].cursor);
+      if (posting->articleID != next) continue;
+      result.score += TermScore(&terms[i], posting, db);
+      result.freq += posting->freq;
+      terms[i].cursor++;
+    }
+    ResultOffer(heap, heapSize, &result);
   }
 }
 
 /**
  * Function: ProcessResponse
  * -------------------------
- * Placeholder implementation for what will become the search of a set of
- * indices for a list of web documents containing the specified word.
+ * Searches the indices for the articles matching the query.  A query is a
+ * list of words separated by whitespace; all of them must appear in an
+ * article unless the words are joined by OR, in which case any of them
+ * may (AND may be written explicitly but is the default).  A query that
+ * joins some words with OR and others with AND is turned down, since
+ * there's no telling which the user meant to come first.  A single word
+ * lists the articles in which it occurs most often, several words are
+ * ranked with BM25.  Stop words are dropped from multi-word queries, and
+ * only the first MAX_QUERY_TERMS of the remaining words are searched for.
  */
 
-static void ProcessResponse(const char *word, hashset *stopWords, hashset *map) {
-  if (WordIsWellFormed(word)) {
-    void *isStopWord = HashSetLookup(stopWords, &word);
-    if (isStopWord != NULL) {
-      printf("\tToo common a word to be taken seriously. Try something more specific.\n");
+static void ProcessResponse(const char *response, rssDatabase *db) {
+  char query[1024];
+  QueryTerm terms[MAX_QUERY_TERMS];
+  int numTerms = 0, numWords = 0, numIgnored = 0;
+  bool matchAny = false, matchAll = false;
+  bool sawOr = false, sawAnd = false;
+  char *save;
+
+  strcpy(query, response);
+  for (char *word = strtok_r(query, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+    if (strcmp(word, "OR") == 0) { sawOr = true; continue; }
+    if (strcmp(word, "AND") == 0) { sawAnd = true; continue; }
+    if (!WordIsWellFormed(word)) {
+      printf( "\tWe won't be allowing words like \"%s\" into our set of indices.\n", word);
       return;
     }
-    MapPair *info = HashSetLookup(map, &word); 
-    if (info == NULL) {
-      printf("None of today's news articles contain the word \"%s\".\n", word);
+    if (numWords > 0) {
+      if (sawOr) matchAny = true;
+      if (sawAnd || !sawOr) matchAll = true;
+    }
+    sawOr = sawAnd = false;
+    numWords++;
+    char term[1024];
+    int length = 0;
+    for (; word[length] != '\0'; length++)
+      term[length] = tolower((unsigned char)word[length]);
+    term[length] = '\0';
+    if (StopWordsContains(&db->stopWords, term))
+      continue;
+    if (numTerms == MAX_QUERY_TERMS) {
+      numIgnored++;
+      continue;
+    }
+    terms[numTerms++].word = word;
+  }
+
+  if (matchAny && matchAll) {
+    printf("\tPlease join the words of \"%s\" either all with OR or all with AND.\n", response);
+    return;
+  }
+  if (numIgnored > 0)
+    printf("\tOnly the first %d words of the query are searched for; the last %d are ignored.\n",
+           MAX_QUERY_TERMS, numIgnored);
+
+  int numFound = 0;
+  for (int i = 0; i < numTerms; i++) {
+    vector *postings = LookupPostings(terms[i].word, db);
+    if (postings == NULL) {
+      if (matchAny) continue;
+      if (numWords == 1)
+        printf("None of today's news articles contain the word \"%s\".\n", terms[i].word);
+      else
+        printf("None of today's news articles match \"%s\".\n", response);
       return;
     }
-    vector *articles = info->second;
-    VectorSort(articles, VectorCmp);
-    for (int i = 0; i < VectorLength(articles) && i < 10; i++) {
-      Article *article = VectorNth(articles, i);
-      char *times = "times";
-      if (article->freq == 1) times = "time";
-      printf("%d.) \"%s\" [search term occurs %d %s]\n\"%s\"\n", i + 1, article->title, article->freq, times, article->URL);
+    terms[numFound].word = terms[i].word;
+    terms[numFound].postings = postings;
+    terms[numFound].cursor = 0;
+    double df = VectorLength(postings), n = VectorLength(&db->articles);
+    terms[numFound].idf = log(1 + (n - df + 0.5) / (df + 0.5));
+    numFound++;
+  }
+  bool allCommon = (numTerms == 0);
+  numTerms = numFound;
+
+  if (numTerms == 0) {
+    if (numWords == 0 || allCommon)
+      printf("\tToo common a word to be taken seriously. Try something more specific.\n");
+    else
+      printf("None of today's news articles match \"%s\".\n", response);
+    return;
+  }
+
+  QueryResult heap[MAX_RESULTS];
+  int heapSize = 0;
+  if (numWords == 1) {
+    vector *postings = terms[0].postings;
+    for (int i = 0; i < VectorLength(postings); i++) {
+      Posting *posting = VectorNth(postings, i);
+      QueryResult result = { posting->freq, posting->articleID, posting->freq };
+      ResultOffer(heap, &heapSize, &result);
     }
+  } else if (matchAny) {
+    MatchAnyTerm(terms, numTerms, db, heap, &heapSize);
   } else {
-    printf( "\tWe won't be allowing words like \"%s\" into our set of indices.\n", word);
+    MatchAllTerms(terms, numTerms, db, heap, &heapSize);
+  }
+  ResultSortHeap(heap, heapSize);
+
+  if (heapSize == 0)
+    printf("None of today's news articles match \"%s\".\n", response);
+  for (int i = 0; i < heapSize; i++) {
+    Article *article = VectorNth(&db->articles, heap[i].articleID);
+    if (numWords == 1) {
+      char *times = "times";
+      if (heap[i].freq == 1) times = "time";
+      printf("%d.) \"%s\" [search term occurs %d %s]\n\"%s\"\n", i + 1, article->title, heap[i].freq, times, article->URL);
+    } else {
+      printf("%d.) \"%s\" [relevance %.2f]\n\"%s\"\n", i + 1, article->title, heap[i].score, article->URL);
+    }
   }
 }
 
@@ -744,13 +1844,12 @@ static void ProcessResponse(const char *word, hashset *stopWords, hashset *map)
  */
 
 static bool WordIsWellFormed(const char *word) {
-  int i;
-  if (strlen(word) == 0)
+  if (word[0] == '\0')
     return true;
-  if (!isalpha((int)word[0]))
+  if (!(charClasses[(unsigned char)word[0]] & CHAR_WORD_START))
     return false;
-  for (i = 1; i < strlen(word); i++)
-    if (!isalnum((int)word[i]) && (word[i] != '-'))
+  for (int i = 1; word[i] != '\0'; i++)
+    if (!(charClasses[(unsigned char)word[i]] & CHAR_WORD))
       return false;
 
   return true;
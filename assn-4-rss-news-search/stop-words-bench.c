@@ -0,0 +1,132 @@
+/**
+ * File: stop-words-bench.c
+ * ------------------------
+ * Measures the per-token cost of stop word filtering, comparing the chained
+ * hashset the indexer used to filter with against the stopwords perfect hash.
+ *
+ *   usage: ./stop-words-bench [<text file> [<repetitions>]]
+ *
+ * The text file (by default the sample article tmp_doc) is split into
+ * lowercase tokens, and every token is looked up in both sets.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashset.h"
+#include "stop-words.h"
+#include "streamtokenizer.h"
+
+#define NUM_BUCKETS_STOP 1009
+
+static const char *const kStopWords = "data/stop-words.txt";
+static const char *const kDefaultTextFile = "tmp_doc";
+
+/* Same hash the indexer used for its stop word hashset. */
+static const signed long kHashMultiplier = -1664117991L;
+static int StringHash(const void *s, int numBuckets) {
+  int i;
+  unsigned long hashcode = 0;
+  for (i = 0; i < strlen(*(char**)s); i++) 
+    hashcode = hashcode * kHashMultiplier + tolower( (*(char **)s)[i] );
+  return hashcode % numBuckets;                                
+}
+
+static int StringCmp(const void *s1, const void *s2) {
+  return strcasecmp(*(char **)s1, *(char **)s2);
+}
+
+static void StringFree(void *string) {
+  free(*(char **)string);
+}
+
+static double CurrentTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void LoadHashSet(hashset *stopWords) {
+  FILE *infile = fopen(kStopWords, "r");
+  streamtokenizer st;
+  char buffer[1024];
+  assert(infile != NULL);
+  HashSetNew(stopWords, sizeof(char *), NUM_BUCKETS_STOP, StringHash, StringCmp, StringFree);
+  STNew(&st, infile, "\r\n", true);
+  while (STNextToken(&st, buffer, sizeof(buffer))) {
+    char *cpy = strdup(buffer);
+    HashSetEnter(stopWords, &cpy);
+  }
+  STDispose(&st);
+  fclose(infile);
+}
+
+/*
+ * Splits the text file into lowercase runs of letters, digits and '-',
+ * which is close enough to what the indexer feeds the filter.
+ */
+static void LoadTokens(const char *fileName, vector *tokens) {
+  FILE *infile = fopen(fileName, "r");
+  char token[1024];
+  int length = 0, ch;
+  assert(infile != NULL);
+  VectorNew(tokens, sizeof(char *), StringFree, 1024);
+  do {
+    ch = getc(infile);
+    if (ch != EOF && (isalnum(ch) || ch == '-') && length < sizeof(token) - 1) {
+      token[length++] = tolower(ch);
+    } else if (length > 0) {
+      token[length] = '\0';
+      char *cpy = strdup(token);
+      VectorAppend(tokens, &cpy);
+      length = 0;
+    }
+  } while (ch != EOF);
+  fclose(infile);
+}
+
+int main(int argc, char **argv) {
+  const char *textFile = (argc > 1) ? argv[1] : kDefaultTextFile;
+  int repetitions = (argc > 2) ? atoi(argv[2]) : 200;
+  hashset chained;
+  stopwords perfect;
+  vector tokens;
+
+  double start = CurrentTime();
+  LoadHashSet(&chained);
+  double chainedLoad = CurrentTime() - start;
+  start = CurrentTime();
+  StopWordsNew(&perfect, kStopWords);
+  double perfectLoad = CurrentTime() - start;
+  LoadTokens(textFile, &tokens);
+
+  int numTokens = VectorLength(&tokens);
+  long chainedHits = 0, perfectHits = 0;
+  start = CurrentTime();
+  for (int r = 0; r < repetitions; r++)
+    for (int i = 0; i < numTokens; i++)
+      if (HashSetLookup(&chained, VectorNth(&tokens, i)) != NULL) chainedHits++;
+  double chainedTime = CurrentTime() - start;
+  start = CurrentTime();
+  for (int r = 0; r < repetitions; r++)
+    for (int i = 0; i < numTokens; i++)
+      if (StopWordsContains(&perfect, *(char **)VectorNth(&tokens, i))) perfectHits++;
+  double perfectTime = CurrentTime() - start;
+
+  double lookups = (double)numTokens * repetitions;
+  printf("%d stop words, %d tokens from %s, %d repetitions\n",
+         StopWordsCount(&perfect), numTokens, textFile, repetitions);
+  printf("chained hashset: %7.1f ns/token (%ld stop words, built in %.3f ms)\n",
+         chainedTime / lookups * 1e9, chainedHits, chainedLoad * 1e3);
+  printf("perfect hash:    %7.1f ns/token (%ld stop words, built in %.3f ms)\n",
+         perfectTime / lookups * 1e9, perfectHits, perfectLoad * 1e3);
+
+  HashSetDispose(&chained);
+  StopWordsDispose(&perfect);
+  VectorDispose(&tokens);
+  return (chainedHits == perfectHits) ? 0 : 1;
+}
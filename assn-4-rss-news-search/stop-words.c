@@ -0,0 +1,231 @@
+/**
+ * File: stop-words.c
+ * ------------------
+ * Implements the stop word set as a minimal perfect hash built with
+ * the hash-and-displace method.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stop-words.h"
+#include "streamtokenizer.h"
+#include "vector.h"
+
+/*
+ * Function: WordHash
+ * ------------------
+ * 32-bit FNV-1a hash of the word, which is the only pass made over
+ * its characters, starting from a basis changed by the seed.  The length
+ * is returned through the third parameter.
+ */
+static uint32_t WordHash(const char *word, uint32_t seed, int *length) {
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  const char *ch = word;
+  for (; *ch != '\0'; ch++)
+    hash = (hash ^ (unsigned char)*ch) * 16777619u;
+  *length = ch - word;
+  return hash;
+}
+
+/*
+ * Function: Mix
+ * -------------
+ * Scrambles the word hash with a seed (the murmur3 finalizer), so that
+ * each seed yields a different, well spread position for the same word.
+ */
+static uint32_t Mix(uint32_t hash, uint32_t seed) {
+  hash ^= seed * 0x9e3779b9u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+typedef struct {
+  uint32_t hash;
+  int bucket;
+  const char *word;
+} entry;
+
+static int CompareByHash(const void *p1, const void *p2) {
+  const entry *a = p1, *b = p2;
+  if (a->hash != b->hash) return (a->hash > b->hash) - (a->hash < b->hash);
+  return strcmp(a->word, b->word);
+}
+
+/*
+ * Function: RemoveDuplicates
+ * --------------------------
+ * Drops the repeated words from the entries, which must be sorted by
+ * CompareByHash so that equal words sit next to each other, and returns
+ * how many distinct words are left, or -1 if two distinct words share a
+ * hash.  No seed could ever send those two to different slots, so the
+ * words have to be hashed again with another seed.
+ */
+static int RemoveDuplicates(entry entries[], int numEntries) {
+  int numDistinct = 0;
+  for (int i = 0; i < numEntries; i++) {
+    if (numDistinct > 0 && entries[numDistinct - 1].hash == entries[i].hash) {
+      if (strcmp(entries[numDistinct - 1].word, entries[i].word) != 0) return -1;
+      continue;
+    }
+    entries[numDistinct++] = entries[i];
+  }
+  return numDistinct;
+}
+
+static int CompareByBucket(const void *p1, const void *p2) {
+  const entry *a = p1, *b = p2;
+  return (a->bucket > b->bucket) - (a->bucket < b->bucket);
+}
+
+typedef struct {
+  int bucket;
+  int first;
+  int size;
+} bucketRange;
+
+static int CompareBySizeDescending(const void *p1, const void *p2) {
+  const bucketRange *a = p1, *b = p2;
+  if (a->size != b->size) return b->size - a->size;
+  return a->bucket - b->bucket;
+}
+
+/*
+ * Function: PlaceWords
+ * --------------------
+ * Buckets the words by their unseeded hash and, largest bucket first,
+ * searches for the seed that sends every word of the bucket to a free
+ * slot.  Small buckets placed last find a free slot quickly, which is
+ * what lets the table be exactly as large as the set.
+ */
+static void PlaceWords(stopwords *sw, entry entries[]) {
+  int n = sw->numWords;
+  for (int i = 0; i < n; i++)
+    entries[i].bucket = Mix(entries[i].hash, 0) % n;
+  qsort(entries, n, sizeof(entry), CompareByBucket);
+
+  bucketRange *ranges = malloc(n * sizeof(bucketRange));
+  int numRanges = 0;
+  for (int i = 0; i < n; ) {
+    int first = i;
+    while (i < n && entries[i].bucket == entries[first].bucket) i++;
+    ranges[numRanges].bucket = entries[first].bucket;
+    ranges[numRanges].first = first;
+    ranges[numRanges].size = i - first;
+    numRanges++;
+  }
+  qsort(ranges, numRanges, sizeof(bucketRange), CompareBySizeDescending);
+
+  int slotsInBucket[64];
+  for (int r = 0; r < numRanges; r++) {
+    bucketRange *range = &ranges[r];
+    assert(range->size <= sizeof(slotsInBucket) / sizeof(slotsInBucket[0]));
+    for (uint32_t seed = 1; ; seed++) {
+      int placed = 0;
+      for (; placed < range->size; placed++) {
+        int slot = Mix(entries[range->first + placed].hash, seed) % n;
+        bool taken = (sw->slots[slot] != NULL);
+        for (int k = 0; k < placed && !taken; k++)
+          taken = (slotsInBucket[k] == slot);
+        if (taken) break;
+        slotsInBucket[placed] = slot;
+      }
+      if (placed == range->size) {
+        for (int k = 0; k < placed; k++)
+          sw->slots[slotsInBucket[k]] = entries[range->first + k].word;
+        sw->seeds[range->bucket] = seed;
+        break;
+      }
+    }
+  }
+  free(ranges);
+}
+
+static const char *const kNewLineDelimiters = "\r\n";
+
+void StopWordsNew(stopwords *sw, const char *stopWordsFile) {
+  FILE *infile;
+  streamtokenizer st;
+  char buffer[1024];
+  vector words;
+
+  infile = fopen(stopWordsFile, "r");
+  assert(infile != NULL);
+
+  // first pass: collect the lowercased words and their total size
+  long storageLength = 0;
+  VectorNew(&words, sizeof(char *), NULL, 256);
+  STNew(&st, infile, kNewLineDelimiters, true);
+  while (STNextToken(&st, buffer, sizeof(buffer))) {
+    for (char *ch = buffer; *ch != '\0'; ch++)
+      *ch = tolower((unsigned char)*ch);
+    char *word = strdup(buffer);
+    VectorAppend(&words, &word);
+    storageLength += strlen(word) + 1;
+  }
+  STDispose(&st);
+  fclose(infile);
+
+  // hash each word once and sort the duplicates out, hashing again with
+  // the next seed in the unlikely case that two distinct words collide
+  int numWords = VectorLength(&words);
+  entry *entries = malloc((numWords + 1) * sizeof(entry));
+  sw->hashSeed = 0;
+  while (true) {
+    for (int i = 0; i < numWords; i++) {
+      int length;
+      entries[i].word = *(char **)VectorNth(&words, i);
+      entries[i].hash = WordHash(entries[i].word, sw->hashSeed, &length);
+    }
+    qsort(entries, numWords, sizeof(entry), CompareByHash);
+    sw->numWords = RemoveDuplicates(entries, numWords);
+    if (sw->numWords >= 0) break;
+    sw->hashSeed++;
+  }
+
+  // pack the distinct words into one block
+  sw->storage = malloc(storageLength + 1);
+  sw->maxLength = 0;
+  char *next = sw->storage;
+  for (int i = 0; i < sw->numWords; i++) {
+    int length = strlen(entries[i].word);
+    strcpy(next, entries[i].word);
+    entries[i].word = next;
+    next += length + 1;
+    if (length > sw->maxLength) sw->maxLength = length;
+  }
+  for (int i = 0; i < numWords; i++)
+    free(*(char **)VectorNth(&words, i));
+  VectorDispose(&words);
+
+  int tableSize = (sw->numWords > 0) ? sw->numWords : 1;
+  sw->seeds = calloc(tableSize, sizeof(uint32_t));
+  sw->slots = calloc(tableSize, sizeof(char *));
+  if (sw->numWords > 0) PlaceWords(sw, entries);
+  free(entries);
+}
+
+void StopWordsDispose(stopwords *sw) {
+  free(sw->seeds);
+  free(sw->slots);
+  free(sw->storage);
+}
+
+int StopWordsCount(const stopwords *sw) { return sw->numWords; }
+
+bool StopWordsContains(const stopwords *sw, const char *word) {
+  if (sw->numWords == 0) return false;
+  int length;
+  uint32_t hash = WordHash(word, sw->hashSeed, &length);
+  if (length > sw->maxLength) return false;
+  uint32_t seed = sw->seeds[Mix(hash, 0) % sw->numWords];
+  const char *candidate = sw->slots[Mix(hash, seed) % sw->numWords];
+  return strcmp(candidate, word) == 0;
+}
@@ -0,0 +1,73 @@
+#ifndef __stopwords_
+#define __stopwords_
+
+#include <stdint.h>
+#include "bool.h"
+
+/* File: stop-words.h
+ * ------------------
+ * Defines the interface for the set of stop words: words too common to
+ * be worth indexing.  The set is read-only once built, so it can be shared
+ * by any number of threads without locking.
+ */
+
+/**
+ * Type: stopwords
+ * ---------------
+ * The concrete representation of the set.  The words are compiled at load
+ * time into a minimal perfect hash: every word hashes to a bucket, and each
+ * bucket stores the seed that sends all of its words to distinct slots of a
+ * table with exactly one slot per word.  A lookup is then one pass over the
+ * word to hash it, two table reads and a single strcmp, whatever the word.
+ * As with the hashset, the fields are only public because C offers no
+ * easy way to hide them.
+ */
+
+typedef struct {
+  int numWords;
+  int maxLength;
+  uint32_t hashSeed;     // of the word hash, so that no two words share one
+  uint32_t *seeds;       // per bucket, one bucket per word
+  const char **slots;    // the word stored at each slot
+  char *storage;         // backing store for all of the words
+} stopwords;
+
+/**
+ * Function: StopWordsNew
+ * Usage: StopWordsNew(&stopWords, "data/stop-words.txt");
+ * -------------------------------------------------------
+ * Reads the stop words, one per line, from the specified file and
+ * builds the set.  Words are stored in lowercase, and those listed more
+ * than once are stored once.  An assert is raised if the file can't be
+ * opened.
+ */
+
+void StopWordsNew(stopwords *sw, const char *stopWordsFile);
+
+/**
+ * Function: StopWordsDispose
+ * --------------------------
+ * Releases all of the memory held by the set.
+ */
+
+void StopWordsDispose(stopwords *sw);
+
+/**
+ * Function: StopWordsCount
+ * ------------------------
+ * Returns the number of distinct stop words in the set.
+ */
+
+int StopWordsCount(const stopwords *sw);
+
+/**
+ * Function: StopWordsContains
+ * ---------------------------
+ * Returns true if and only if the word is one of the stop words.  The
+ * word must already be in lowercase (the indexer lowercases every term
+ * anyway), which saves folding case on every lookup.
+ */
+
+bool StopWordsContains(const stopwords *sw, const char *word);
+
+#endif
@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Checks the crawl cache (-c) against a stand-in HTTP server on localhost.
+#
+# usage: ./test-crawl-cache.sh [<rss-news-search binary>]
+#
+# The stand-in server (python3) serves copies of the sample articles with
+# ETag and Last-Modified validators and answers conditional requests with
+# 304 Not Modified, except under /plain/, where it sends no validators at
+# all and the article can only be recognized by its body hash.  The feed is
+# crawled three times:
+#   1. with no cache file: every article is scanned;
+#   2. nothing changed: no article is scanned, and queries answer exactly
+#      as they did after the first crawl;
+#   3. one article changed: only that one is scanned again.
+
+PROG=${1:-./rss-news-search}
+WORK=$(mktemp -d)
+QUERIES='batumi
+smiling
+karabakh
+batumi smiling
+'
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/www/plain"
+cp tmp_doc "$WORK/www/a1.html"
+cp data/test1.txt "$WORK/www/a2.html"
+cp data/test2.txt "$WORK/www/a3.html"
+cp data/test3.txt "$WORK/www/plain/a4.html"
+
+cat > "$WORK/server.py" <<'EOF'
+import email.utils, functools, http.server, os, sys
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        try:
+            with open(path, 'rb') as f:
+                body = f.read()
+        except OSError:
+            self.send_error(404)
+            return
+        validators = not self.path.startswith('/plain/')
+        st = os.stat(path)
+        etag = '"%x-%x"' % (st.st_mtime_ns, st.st_size)
+        modified = email.utils.formatdate(st.st_mtime, usegmt=True)
+        if validators:
+            match = self.headers.get('If-None-Match')
+            since = self.headers.get('If-Modified-Since')
+            if match == etag or (match is None and since == modified):
+                self.send_response(304)
+                self.send_header('ETag', etag)
+                self.end_headers()
+                return
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/html')
+        self.send_header('Content-Length', str(len(body)))
+        if validators:
+            self.send_header('ETag', etag)
+            self.send_header('Last-Modified', modified)
+        self.end_headers()
+        self.wfile.write(body)
+
+server = http.server.ThreadingHTTPServer(('127.0.0.1', 0),
+                                         functools.partial(Handler, directory=sys.argv[1]))
+with open(sys.argv[2], 'w') as f:
+    f.write(str(server.server_address[1]))
+server.serve_forever()
+EOF
+
+python3 "$WORK/server.py" "$WORK/www" "$WORK/port" 2> "$WORK/server.log" &
+SERVER=$!
+for i in $(seq 1 50); do
+  [ -s "$WORK/port" ] && break
+  sleep 0.1
+done
+PORT=$(cat "$WORK/port")
+SITE="http://127.0.0.1:$PORT"
+
+{
+  echo '<rss><channel>'
+  for a in a1.html a2.html a3.html plain/a4.html; do
+    echo "<item><title>$a</title><link>$SITE/$a</link><description>$a</description></item>"
+  done
+  echo '</channel></rss>'
+} > "$WORK/www/feed.xml"
+echo "Stand-in feed: $SITE/feed.xml" > "$WORK/feeds.txt"
+
+FAILED=0
+crawl() {
+  printf '%s\n' "$QUERIES" | $PROG -c "$WORK/cache" "$WORK/feeds.txt" > "$WORK/$1.out"
+  sed -n '/^Crawl cache/,$p' "$WORK/$1.out" | tail -n +2 > "$WORK/$1.answers"
+  if grep -qF "$2" "$WORK/$1.out"; then
+    echo "PASS: $1: $2"
+  else
+    echo "FAIL: $1: expected \"$2\", got \"$(grep '^Crawl cache' "$WORK/$1.out")\""
+    FAILED=1
+  fi
+}
+
+crawl first "Crawl cache: 0 of 4 articles unchanged since the last crawl (0 not modified, 0 with the same content)."
+crawl second "Crawl cache: 4 of 4 articles unchanged since the last crawl (3 not modified, 1 with the same content)."
+if cmp -s "$WORK/first.answers" "$WORK/second.answers"; then
+  echo "PASS: second: queries answered the same as after the first crawl"
+else
+  echo "FAIL: second: queries answered differently than after the first crawl"
+  FAILED=1
+fi
+echo "Updated today." >> "$WORK/www/a1.html"
+crawl third "Crawl cache: 3 of 4 articles unchanged since the last crawl (2 not modified, 1 with the same content)."
+
+echo "Requests answered 304 by the stand-in server: $(grep -c '" 304 ' "$WORK/server.log")"
+exit $FAILED
@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <sched.h>
 
 #include "teller.h"
 #include "account.h"
@@ -13,26 +15,55 @@
 #include "report.h"
 
 /*
- * initialize the account based on the passed-in information.
+ * initialize the account based on the passed-in information.  The balance
+ * and version are kept in stateSlot, or in the account's ownState if that's
+ * NULL.
  */
 void
 Account_Init(Bank *bank, Account *account, int id, int branch,
-             AccountAmount initialAmount)
+             AccountAmount initialAmount, AccountState *stateSlot)
 {
   extern int testfailurecode;
 
-  pthread_mutex_init(&(account->lock), NULL);
+  Lock_Init(&(account->lock), bank->lockKind);
   account->accountNumber = Account_MakeAccountNum(branch, id);
-  account->balance = initialAmount;
+  account->state = (stateSlot != NULL) ? stateSlot : account->ownState;
+  atomic_init(&account->state->version, 0);
+  atomic_init(&account->state->balance, initialAmount);
   if (testfailurecode) {
     // To test failures, we initialize every 4th account with a negative value
     if ((id & 0x3) == 0) {
-      account->balance = -1;
+      atomic_init(&account->state->balance, -1);
     }
   }
 
 }
 
+/*
+ * look up the account layout with the given name ("packed", "padded" or
+ * "split").  Returns -1 if there is no such layout, 0 otherwise.
+ */
+int
+Account_ParseLayout(const char *name, AccountLayout *layout)
+{
+  static const struct {
+    const char *name;
+    AccountLayout layout;
+  } layouts[] = {
+    { "packed", ACCOUNT_LAYOUT_PACKED },
+    { "padded", ACCOUNT_LAYOUT_PADDED },
+    { "split",  ACCOUNT_LAYOUT_SPLIT },
+  };
+
+  for (unsigned int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    if (strcmp(name, layouts[l].name) == 0) {
+      *layout = layouts[l].layout;
+      return 0;
+    }
+  }
+  return -1;
+}
+
 /*
  * get the ID of the branch which the account is in.
  */
@@ -61,17 +92,23 @@ Account_LookupByNumber(Bank *bank, AccountNumber accountNum)
 {
   BranchID branchID =  AccountNum_GetBranchID(accountNum);
   int branchIndex = AcountNum_Subaccount(accountNum);
-  return &(bank->branches[branchID].accounts[branchIndex]);
+  return Branch_Account(&bank->branches[branchID], branchIndex);
 }
 
 /*
- * adjust the balance of the account.
+ * adjust the balance of the account.  With the atomic engine the
+ * adjustment is a single atomic add, so no lock is needed.
  */
 void
 Account_Adjust(Bank *bank, Account *account, AccountAmount amount,
                int updateBranch)
 {
-  account->balance = Account_Balance(account) + amount;
+  if (bank->engine == BANK_ENGINE_ATOMIC) {
+    atomic_fetch_add(&account->state->balance, amount);
+  } else {
+    atomic_store_explicit(&account->state->balance, Account_Balance(account) + amount,
+                          memory_order_relaxed);
+  }
   if (updateBranch) {
     Branch_UpdateBalance(bank, AccountNum_GetBranchID(account->accountNumber),
                          amount);
@@ -84,10 +121,104 @@ Account_Adjust(Bank *bank, Account *account, AccountAmount amount,
 AccountAmount
 Account_Balance(Account *account)
 {
-  AccountAmount balance = account->balance; Y;
+  AccountAmount balance = atomic_load_explicit(&account->state->balance,
+                                               memory_order_relaxed); Y;
   return balance;
 }
 
+/*
+ * atomically take amount out of the account, unless the balance doesn't
+ * cover it, without taking the account lock (atomic engine only).
+ * Returns -1 if the funds are insufficient, 0 otherwise.
+ */
+int
+Account_AtomicWithdraw(Bank *bank, Account *account, AccountAmount amount,
+                       int updateBranch)
+{
+  AccountAmount balance = atomic_load(&account->state->balance); Y;
+  do {
+    if (amount > balance) {
+      return -1;
+    }
+  } while (!atomic_compare_exchange_weak(&account->state->balance, &balance,
+                                         balance - amount));
+  if (updateBranch) {
+    Branch_UpdateBalance(bank, AccountNum_GetBranchID(account->accountNumber),
+                         -amount);
+  }
+  Y;
+  return 0;
+}
+
+/*
+ * read the balance of the account for a transaction of the STM engine,
+ * storing the version it was read at in *version.  The read waits out a
+ * commit that holds the account, and is done again if one came in between.
+ */
+AccountAmount
+Account_StmRead(Account *account, uint64_t *version)
+{
+  for (;;) {
+    uint64_t before = atomic_load_explicit(&account->state->version,
+                                           memory_order_acquire);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+    AccountAmount balance = atomic_load_explicit(&account->state->balance,
+                                                 memory_order_relaxed); Y;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&account->state->version,
+                             memory_order_relaxed) == before) {
+      *version = before;
+      return balance;
+    }
+  }
+}
+
+/*
+ * check that the account is still at the version a transaction read it
+ * at.  Returns -1 if a commit has changed (or holds) it since, 0 otherwise.
+ */
+int
+Account_StmValidate(Account *account, uint64_t version)
+{
+  return (atomic_load_explicit(&account->state->version,
+                               memory_order_acquire) == version) ? 0 : -1;
+}
+
+/*
+ * take the account for a commit of the STM engine, if it is still at the
+ * version the transaction read it at.  Returns -1 if it is not, 0 once the
+ * account is taken (and its version odd).
+ */
+int
+Account_StmLock(Account *account, uint64_t version)
+{
+  Y;
+  if (!atomic_compare_exchange_strong_explicit(&account->state->version, &version,
+                                               version + 1,
+                                               memory_order_acquire,
+                                               memory_order_relaxed)) {
+    return -1;
+  }
+  /* so that a reader who sees the new balance sees the odd version too */
+  atomic_thread_fence(memory_order_release);
+  return 0;
+}
+
+/*
+ * give back an account taken by Account_StmLock, leaving it at version:
+ * two past the one it was taken at if the commit wrote the balance, the
+ * same one if the commit backed out.
+ */
+void
+Account_StmUnlock(Account *account, uint64_t version)
+{
+  atomic_store_explicit(&account->state->version, version, memory_order_release);
+  Y;
+}
+
 /*
  * make the account number based on the branch number and
  * the branch-wise subaccount number.
@@ -2,16 +2,49 @@
 #define _ACCOUNT_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+#include "lock.h"
+
 
 typedef uint64_t AccountNumber;
 typedef int64_t AccountAmount;
 
+/*
+ * How the accounts of a branch are laid out in memory.
+ */
+typedef enum {
+  ACCOUNT_LAYOUT_PACKED,  /* back to back, so neighbours share cache lines */
+  ACCOUNT_LAYOUT_PADDED,  /* each account starts on a cache line of its own */
+  ACCOUNT_LAYOUT_SPLIT,   /* the (hot) balances and versions in an array of
+                           * their own, apart from the account numbers and
+                           * locks */
+} AccountLayout;
+
+/*
+ * The hot part of an account, which every transaction on it writes.  The
+ * balance is atomic so that the atomic engine can update it without
+ * taking the lock; the mutex engine only reads and writes it under the lock.
+ * version is the STM engine's stamp of the balance: it goes up by one when
+ * a commit takes the account (so it is odd while the commit writes) and by
+ * one more when the commit is done.
+ */
+typedef struct AccountState {
+  _Atomic AccountAmount balance;
+  _Atomic uint64_t version;
+} AccountState;
+
+/*
+ * state is the account's ownState, which follows it in memory, except with
+ * the split layout: there state points into the states array of the
+ * branch, and the account is allocated without an ownState at all.
+ */
 typedef struct Account {
   AccountNumber accountNumber;
-  AccountAmount balance;
-  pthread_mutex_t lock;
+  AccountState *state;
+  Lock lock;
+  AccountState ownState[];
 } Account;
 
 
@@ -22,11 +55,25 @@ void Account_Adjust(struct Bank *bank, Account *account,
 
 AccountAmount Account_Balance(Account *account);
 
+int Account_AtomicWithdraw(struct Bank *bank, Account *account,
+                           AccountAmount amount, int updateBranch);
+
+AccountAmount Account_StmRead(Account *account, uint64_t *version);
+
+int Account_StmValidate(Account *account, uint64_t version);
+
+int Account_StmLock(Account *account, uint64_t version);
+
+void Account_StmUnlock(Account *account, uint64_t version);
+
 AccountNumber Account_MakeAccountNum(int branch, int subaccount);
 
 int Account_IsSameBranch(AccountNumber accountNum1, AccountNumber accountNum2);
 
 void Account_Init(Bank *bank, Account *account, int id, int branch,
-                  AccountAmount initialAmount);
+                  AccountAmount initialAmount,
+                  AccountState *stateSlot);
+
+int Account_ParseLayout(const char *name, AccountLayout *layout);
 
 #endif /* _ACCOUNT_H */
@@ -2,6 +2,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "teller.h"
 #include "account.h"
@@ -11,67 +14,195 @@
 
 #include "action.h"
 
+/*
+ * The commands are split into this many days, with a report at the end of
+ * every day but the last.
+ */
+#define COMMANDS_PER_REPORT 4
+
+/*
+ * Number of commands the work-stealing scheduler hands out at once.
+ */
+#define ACTION_CHUNK 256
+
+/*
+ * Most chunks a worker steals at once, which bounds its buffer for them.
+ */
+#define ACTION_MAX_STEAL 256
+
 static int numBranches;
 static int numAcctPerBranch;
 static int amountMax;
-static int cmdsPerReportPerWorker;
+static int totalCommands;
+static int numSchedWorkers;
+static ActionScheduler scheduler;
+static uint64_t randomKey;
 
+/*
+ * Commands are numbered 0 to totalCommands - 1, and command i is made from
+ * random numbers that depend only on the seed, i and how many numbers the
+ * command drew before (a counter-based generator).  Any worker can make any
+ * command without making the ones before it, so both schedulers just hand
+ * out command numbers, and each day runs exactly the same commands for any
+ * number of workers.
+ */
+typedef struct CommandRandom {
+  uint64_t command;
+  unsigned int draw;
+} CommandRandom;
+
+/*
+ * Per-worker state of the static scheduler: the worker's share of the
+ * day is commands [next, end).
+ */
 static struct {
 
-  int cmdCount;
-  int nextReport;
-  int nextSeed;
-  unsigned int seed;
-  int seedList[MAX_WORKERS];
+  int day;
+  int next;
+  int end;
 
 } workerState[MAX_WORKERS];
 
+/*
+ * The work-stealing scheduler cuts every day into chunks of ACTION_CHUNK
+ * commands, dealt out in turn to per-worker deques.  A worker takes chunks
+ * from the bottom of its own deque; once that is empty it steals half of
+ * the chunks left in another worker's deque, from the top.
+ */
+typedef struct Chunk {
+  int first;
+  int count;
+} Chunk;
+
+typedef struct Deque {
+  pthread_mutex_t lock;
+  int top;         /* chunks[top] is the next one to be stolen */
+  int bottom;      /* chunks[bottom - 1] is the next one the owner runs */
+  Chunk *chunks;
+} Deque;
+
+static Deque *deques;   /* numSchedWorkers deques for each day */
+static int numDeques;   /* in deques, which may be from a run with other workers */
+
+static struct {
+
+  int day;
+  int next;        /* the worker's current chunk is commands [next, end) */
+  int end;
+  int chunksStolen;
+
+} stealState[MAX_WORKERS];
+
+static void BuildDeques(int numWorkers);
+
+/*
+ * first command of the day; day COMMANDS_PER_REPORT is the end of the run
+ */
+static int
+DayStart(int day)
+{
+  return (int) ((int64_t) totalCommands * day / COMMANDS_PER_REPORT);
+}
+
+/*
+ * set the worker's share of the day for the static scheduler
+ */
+static void
+StartStaticDay(int workerNum, int day)
+{
+  int start = DayStart(day);
+  int64_t length = DayStart(day + 1) - start;
+
+  workerState[workerNum].day = day;
+  workerState[workerNum].next = start + (int) (length * workerNum / numSchedWorkers);
+  workerState[workerNum].end = start + (int) (length * (workerNum + 1) / numSchedWorkers);
+}
+
 /*
  * pre-assign actions to the workers by initilizing the worker states
  */
 void
 Action_Init(int configNumBranches, int configNumAccounts, int numCommands,
-            int maxTransaction, int numWorkers, unsigned int initSeed)
+            int maxTransaction, int numWorkers, unsigned int initSeed,
+            ActionScheduler configScheduler)
 {
+  assert(numWorkers >= 1 && numWorkers <= MAX_WORKERS);
+
   numBranches = configNumBranches;
   numAcctPerBranch = configNumAccounts/configNumBranches;
   amountMax = maxTransaction;
+  totalCommands = numCommands;
+  numSchedWorkers = numWorkers;
+  scheduler = configScheduler;
+  randomKey = initSeed;
 
-  const int COMMANDS_PER_REPORT = 4;
-  cmdsPerReportPerWorker = (numCommands / COMMANDS_PER_REPORT)/numWorkers;
+  if (scheduler == ACTION_SCHED_STEAL) {
+    BuildDeques(numWorkers);
+  }
 
-  int perWorker = numCommands / numWorkers;
   for (int w = 0; w < numWorkers; w++) {
-    workerState[w].cmdCount = perWorker;
-    workerState[w].nextReport = perWorker - cmdsPerReportPerWorker;
-
-    numCommands -= perWorker;
+    StartStaticDay(w, 0);
+  }
+}
 
-    if (numCommands <= 0)
-      break;
+/*
+ * free the deques of the previous run, if any, and deal out the chunks of
+ * every day to the deques in turn.
+ */
+static void
+BuildDeques(int numWorkers)
+{
+  for (int d = 0; d < numDeques; d++) {
+    pthread_mutex_destroy(&deques[d].lock);
+    free(deques[d].chunks);
   }
+  free(deques);
+  numDeques = COMMANDS_PER_REPORT * numWorkers;
+  deques = malloc(numDeques * sizeof(Deque));
+  assert(deques != NULL);
 
-  for (int w = 0; w < MAX_WORKERS; w++) {
-    workerState[w].nextSeed = 0;
-    workerState[w].seed = initSeed + w; /* Give each worker a different start seed */
+  for (int day = 0; day < COMMANDS_PER_REPORT; day++) {
+    int start = DayStart(day);
+    int end = DayStart(day + 1);
+    /* a stolen chunk may end up in any deque, so each can take them all */
+    int maxChunks = (end - start + ACTION_CHUNK - 1) / ACTION_CHUNK;
 
-    for (int i = 0; i < MAX_WORKERS; i++) {
-      workerState[w].seedList[i] = (w + (i * numWorkers)) % MAX_WORKERS;
+    Deque *dayDeques = &deques[day * numWorkers];
+    for (int w = 0; w < numWorkers; w++) {
+      pthread_mutex_init(&dayDeques[w].lock, NULL);
+      dayDeques[w].top = dayDeques[w].bottom = 0;
+      dayDeques[w].chunks = malloc((maxChunks + 1) * sizeof(Chunk));
+      assert(dayDeques[w].chunks != NULL);
     }
+
+    /*
+     * The owner runs its deque from the bottom, so deal the chunks last to
+     * first: each worker then starts on the earliest of its chunks.
+     */
+    for (int c = maxChunks - 1; c >= 0; c--) {
+      Deque *deque = &dayDeques[c % numWorkers];
+      Chunk *chunk = &deque->chunks[deque->bottom++];
+      chunk->first = start + c * ACTION_CHUNK;
+      chunk->count = (end - chunk->first < ACTION_CHUNK) ? end - chunk->first : ACTION_CHUNK;
+    }
+  }
+
+  for (int w = 0; w < MAX_WORKERS; w++) {
+    stealState[w].day = 0;
+    stealState[w].next = stealState[w].end = 0;
+    stealState[w].chunksStolen = 0;
   }
 }
 
 /*
- * get a random integer based on the worker number
+ * get the next random integer of a command: splitmix64 of the seed and
+ * the (command, draw) counter.
  */
 static int
-GetRandom(int workerNum, int isBellDistribution, unsigned int maxValue)
+GetRandom(CommandRandom *random, int isBellDistribution, unsigned int maxValue)
 {
-  int ns = workerState[workerNum].nextSeed % MAX_WORKERS;
-  int ws = workerState[workerNum].seedList[ns];
-
-  DPRINTF('r', ("GetRandom(%d,%d) from seed %d\n",
-                workerNum, isBellDistribution, ws));
+  DPRINTF('r', ("GetRandom(%d) for command %"PRIu64" draw %u\n",
+                isBellDistribution, random->command, random->draw));
 
   if (isBellDistribution) {
     // sum of 3 random numbers gives us something like a bell curve disribution
@@ -79,7 +210,7 @@ GetRandom(int workerNum, int isBellDistribution, unsigned int maxValue)
     do {
       unsigned int sum = 0;
       for (int i = 0; i < 3; i++)
-        sum += rand_r(&workerState[ws].seed) % maxValue;
+        sum += GetRandom(random, 0, 0) % maxValue;
 
       u = sum / 3;
     } while (u >= maxValue);
@@ -87,47 +218,43 @@ GetRandom(int workerNum, int isBellDistribution, unsigned int maxValue)
     return u;
 
   } else {
-    // Uniform random distribution
-    return rand_r(&workerState[ws].seed);
+    // Uniform random distribution over 0..2^31-1, like rand_r
+    uint64_t z = randomKey +
+      (((random->command << 5) | random->draw++) + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (int) (z >> 33);
   }
 }
 
 /*
- * get the next action command for the worker
+ * make the action of the given command number
  */
-int
-Action_GetNext(int workerNum, Action *action, int control)
+static void
+MakeAction(int command, Action *action, int control)
 {
   extern int testfailurecode;
 
-  if (workerState[workerNum].cmdCount <= 0) {
-    action->cmd = ACTION_DONE;
-    return 0;
-  }
-
-  if (workerState[workerNum].cmdCount == workerState[workerNum].nextReport) {
-    workerState[workerNum].nextReport -= cmdsPerReportPerWorker;
-    action->cmd = ACTION_REPORT;
-    action->u.reportArg.workerNum = workerNum;
-    return 0;
-  }
+  CommandRandom random = { (uint64_t) command, 0 };
+  CommandRandom *ws = &random;
 
-  workerState[workerNum].cmdCount--;
+  action->seq = command;
 
-  int sel = GetRandom(workerNum,0,0) & 0x7;
+  int sel = GetRandom(ws,0,0) & 0x7;
   switch (sel) {
   case 0:
   case 1:
   case 2: {
-    int account = GetRandom(workerNum,0,0) % numAcctPerBranch;
-    int branch = GetRandom(workerNum,0,0) % numBranches;
-    int amount   = GetRandom(workerNum,1,amountMax);
+    int account = GetRandom(ws,0,0) % numAcctPerBranch;
+    int branch = GetRandom(ws,0,0) % numBranches;
+    int amount   = GetRandom(ws,1,amountMax);
     action->cmd = (sel == 0) ? ACTION_WITHDRAW : ACTION_DEPOSIT;
     action->u.depwithArg.accountNum = Account_MakeAccountNum(branch, account);
     action->u.depwithArg.amount = amount % amountMax;
-    if ((control & ACTION_NO_FUNDS_FLOW) || 
+    if ((control & ACTION_NO_FUNDS_FLOW) ||
         (testfailurecode && (sel != 0) && ((account & 0x3) == 0))) {
-      /* Either we are told to have no money flows in/out or we need 
+      /* Either we are told to have no money flows in/out or we need
        * to test error handling, so we zero out all requests.  */
       action->u.depwithArg.amount = 0;
     }
@@ -137,11 +264,11 @@ Action_GetNext(int workerNum, Action *action, int control)
   case 3:
   case 4:
   case 5: {
-    int srcAccount = GetRandom(workerNum,0,0) % numAcctPerBranch;
-    int srcBranch = GetRandom(workerNum,0,0) % numBranches;
-    int dstBranch = GetRandom(workerNum,0,0)  % numBranches;
-    int dstAccount = GetRandom(workerNum,0,0) % numAcctPerBranch;
-    int amount   = GetRandom(workerNum,1,amountMax);
+    int srcAccount = GetRandom(ws,0,0) % numAcctPerBranch;
+    int srcBranch = GetRandom(ws,0,0) % numBranches;
+    int dstBranch = GetRandom(ws,0,0)  % numBranches;
+    int dstAccount = GetRandom(ws,0,0) % numAcctPerBranch;
+    int amount   = GetRandom(ws,1,amountMax);
     int noCross = (control & ACTION_NO_CROSS_TRANSFER);
     BranchID branchID = ((sel == 5) || noCross) ? srcBranch : dstBranch;
 
@@ -159,22 +286,179 @@ Action_GetNext(int workerNum, Action *action, int control)
   }
   case 6: {
     action->cmd = ACTION_BRANCH_BALANCE;
-    action->u.branchArg.branchID = (GetRandom(workerNum,0,0) % numBranches);
+    action->u.branchArg.branchID = (GetRandom(ws,0,0) % numBranches);
     break;
   }
   case 7: {
     if (control & ACTION_NO_BANK_BALANCE) {
       //do not generate Bank_Balance
-      DPRINTF('z', ("GetRandom(%d) skipping Bank_Balance\n", workerNum));
+      DPRINTF('z', ("Command %d skipping Bank_Balance\n", command));
       //instead generate branch balance
       action->cmd = ACTION_BRANCH_BALANCE;
-      action->u.branchArg.branchID = (GetRandom(workerNum,0,0) % numBranches);
+      action->u.branchArg.branchID = (GetRandom(ws,0,0) % numBranches);
     } else {
       action->cmd = ACTION_BANK_BALANCE;
     }
     break;
   }
   }
-  workerState[workerNum].nextSeed++;
+}
+
+/*
+ * take the next chunk from the bottom of the worker's own deque for the
+ * day.  Returns 0 if there is none left.
+ */
+static int
+PopChunk(int workerNum, int day, Chunk *chunk)
+{
+  Deque *deque = &deques[day * numSchedWorkers + workerNum];
+  int found = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top) {
+    *chunk = deque->chunks[--deque->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+/*
+ * steal half of the chunks (at least one) left in another worker's deque
+ * for the day: the first is returned, the rest go into the thief's own
+ * deque, which is empty, and can be stolen from there in turn.
+ * Returns 0 if every deque of the day is empty.
+ */
+static int
+StealChunks(int workerNum, int day, Chunk *chunk)
+{
+  Deque *dayDeques = &deques[day * numSchedWorkers];
+
+  for (int i = 1; i < numSchedWorkers; i++) {
+    int victim = (workerNum + i) % numSchedWorkers;
+    Deque *from = &dayDeques[victim];
+    Chunk stolen[ACTION_MAX_STEAL];
+
+    pthread_mutex_lock(&from->lock);
+    int n = (from->bottom - from->top + 1) / 2;
+    if (n > ACTION_MAX_STEAL) {
+      n = ACTION_MAX_STEAL;
+    }
+    for (int c = 0; c < n; c++) {
+      stolen[c] = from->chunks[from->top++];
+    }
+    pthread_mutex_unlock(&from->lock);
+
+    if (n == 0) {
+      continue;
+    }
+    DPRINTF('s', ("Worker %d steals %d chunks from worker %d\n",
+                  workerNum, n, victim));
+    stealState[workerNum].chunksStolen += n;
+
+    Deque *own = &dayDeques[workerNum];
+    pthread_mutex_lock(&own->lock);
+    own->top = own->bottom = 0;
+    for (int c = n - 1; c > 0; c--) {
+      own->chunks[own->bottom++] = stolen[c];
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    *chunk = stolen[0];
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * get the next command number for the worker from the work-stealing
+ * scheduler, or -1 at the end of the day.  The day ends for a worker once
+ * it finds no chunk left to run or steal; nothing is added to the deques
+ * during a day, so by then every command of the day is in the hands of
+ * some worker.
+ */
+static int
+StealNextCommand(int workerNum)
+{
+  if (stealState[workerNum].next == stealState[workerNum].end) {
+    int day = stealState[workerNum].day;
+    Chunk chunk;
+    if (!PopChunk(workerNum, day, &chunk) &&
+        !StealChunks(workerNum, day, &chunk)) {
+      return -1;
+    }
+    stealState[workerNum].next = chunk.first;
+    stealState[workerNum].end = chunk.first + chunk.count;
+  }
+  return stealState[workerNum].next++;
+}
+
+/*
+ * get the next action command for the worker
+ */
+int
+Action_GetNext(int workerNum, Action *action, int control)
+{
+  int command, day;
+
+  if (scheduler == ACTION_SCHED_STEAL) {
+    command = StealNextCommand(workerNum);
+    day = stealState[workerNum].day;
+  } else {
+    command = (workerState[workerNum].next < workerState[workerNum].end) ?
+      workerState[workerNum].next++ : -1;
+    day = workerState[workerNum].day;
+  }
+
+  if (command >= 0) {
+    MakeAction(command, action, control);
+    return 0;
+  }
+
+  if (day == COMMANDS_PER_REPORT - 1) {
+    action->cmd = ACTION_DONE;
+    return 0;
+  }
+
+  if (scheduler == ACTION_SCHED_STEAL) {
+    stealState[workerNum].day = day + 1;
+  } else {
+    StartStaticDay(workerNum, day + 1);
+  }
+  action->cmd = ACTION_REPORT;
+  action->u.reportArg.workerNum = workerNum;
   return 0;
 }
+
+/*
+ * number of chunks the worker has stolen from others
+ */
+int
+Action_ChunksStolen(int workerNum)
+{
+  return stealState[workerNum].chunksStolen;
+}
+
+/*
+ * parse a scheduler name given on the command line.
+ * Returns -1 if the name is unknown, 0 otherwise.
+ */
+int
+Action_ParseScheduler(const char *name, ActionScheduler *sched)
+{
+  static const struct {
+    const char *name;
+    ActionScheduler sched;
+  } schedulers[] = {
+    { "static", ACTION_SCHED_STATIC },
+    { "steal",  ACTION_SCHED_STEAL },
+  };
+
+  for (size_t i = 0; i < sizeof(schedulers) / sizeof(schedulers[0]); i++) {
+    if (strcmp(name, schedulers[i].name) == 0) {
+      *sched = schedulers[i].sched;
+      return 0;
+    }
+  }
+  return -1;
+}
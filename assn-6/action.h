@@ -2,7 +2,7 @@
 #define _ACTION_H
 
 
-#define MAX_WORKERS 16
+#define MAX_WORKERS 256
 
 typedef enum {
   ACTION_DONE,
@@ -14,8 +14,17 @@ typedef enum {
   ACTION_REPORT
 } ActionType;
 
+/*
+ * How the commands are handed out to the workers.
+ */
+typedef enum {
+  ACTION_SCHED_STATIC,  /* each worker gets a fixed share of every day */
+  ACTION_SCHED_STEAL,   /* chunks in per-worker deques, idle workers steal */
+} ActionScheduler;
+
 typedef struct Action {
   ActionType cmd;
+  uint64_t seq;   /* the command's number, from 0 to numCommands - 1 */
   union {
     struct {
       AccountNumber accountNum;
@@ -45,7 +54,12 @@ int Action_GetNext(int workerNum, Action *action, int control);
 void Action_Init(int configNumBranches, int configNumAccounts, int numCommands,
                  int maxTransaction,
                  int numWorkers,
-                 unsigned int initSeed);
+                 unsigned int initSeed,
+                 ActionScheduler scheduler);
+
+int Action_ChunksStolen(int workerNum);
+
+int Action_ParseScheduler(const char *name, ActionScheduler *sched);
 
 
 #endif /* _ACTION_H */
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
 
 #include "error.h"
@@ -17,7 +18,8 @@
 Bank*
 Bank_Init(int numBranches, int numAccounts, AccountAmount initalAmount,
           AccountAmount reportingAmount,
-          int numWorkers)
+          int numWorkers, BankEngine engine, AccountLayout layout,
+          LockKind lockKind)
 {
 
   Bank *bank = malloc(sizeof(Bank));
@@ -26,10 +28,13 @@ Bank_Init(int numBranches, int numAccounts, AccountAmount initalAmount,
     return bank;
   }
 
-  Branch_Init(bank, numBranches, numAccounts, initalAmount);
+  bank->engine = engine;
+  bank->lockKind = lockKind;
+  atomic_init(&bank->waitingReaders, 0);
+
+  Branch_Init(bank, numBranches, numAccounts, initalAmount, numWorkers, layout);
   Report_Init(bank, reportingAmount, numWorkers);
 
-  bank->finishedDay = 0;
 
   pthread_mutex_init(&(bank->lock), NULL);
   pthread_cond_init(&(bank->cond), NULL);
@@ -38,33 +43,45 @@ Bank_Init(int numBranches, int numAccounts, AccountAmount initalAmount,
 }
 
 /*
- * get the balance of the entire bank by adding up all the balances in
- * each branch.
+ * look up the engine with the given name ("mutex", "atomic" or "stm").
+ * Returns -1 if there is no such engine, 0 otherwise.
  */
 int
-Bank_Balance(Bank *bank, AccountAmount *balance)
+Bank_ParseEngine(const char *name, BankEngine *engine)
 {
-  assert(bank->branches);
-
-  for (int branch = 0; branch < bank->numberBranches; branch++)
-    pthread_mutex_lock(&(bank->branches[branch].lock));
-
-  AccountAmount bankTotal = 0;
-  for (unsigned int branch = 0; branch < bank->numberBranches; branch++) {
-    AccountAmount branchBalance;
-    int err = Branch_Balance(bank,bank->branches[branch].branchID, &branchBalance);
-    if (err < 0) {
-      for (int branch = 0; branch < bank->numberBranches; branch++)
-        pthread_mutex_unlock(&(bank->branches[branch].lock));
-      return err;
+  static const struct {
+    const char *name;
+    BankEngine engine;
+  } engines[] = {
+    { "mutex",  BANK_ENGINE_MUTEX },
+    { "atomic", BANK_ENGINE_ATOMIC },
+    { "stm",    BANK_ENGINE_STM },
+  };
+
+  for (unsigned int e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    if (strcmp(name, engines[e].name) == 0) {
+      *engine = engines[e].engine;
+      return 0;
     }
-    bankTotal += branchBalance;
   }
+  return -1;
+}
 
-  for (int branch = 0; branch < bank->numberBranches; branch++)
-    pthread_mutex_unlock(&(bank->branches[branch].lock));
+/*
+ * get the balance of the entire bank: the initial balances of all branches
+ * plus every worker's changes to them.  No lock is taken.  The changes of
+ * all workers are read as one snapshot, validated against the update
+ * counts of every worker (see Branch_DeltaTotal), so the balance is one
+ * the bank really had at some moment during the call: a deposit is never
+ * counted while an earlier one is missed, and money moving between
+ * branches is never counted twice or missed.
+ */
+int
+Bank_Balance(Bank *bank, AccountAmount *balance)
+{
+  assert(bank->branches);
 
-  *balance = bankTotal;
+  *balance = Branch_InitialTotal(bank) + Branch_DeltaTotal(bank);
   
   return 0;
 }
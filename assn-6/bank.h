@@ -1,13 +1,28 @@
 #ifndef _BANK_H
 #define _BANK_H
 
+#include "lock.h"
 
 
+
+/*
+ * How the tellers keep balances consistent.
+ */
+typedef enum {
+  BANK_ENGINE_MUTEX,   /* account mutexes around every update */
+  BANK_ENGINE_ATOMIC,  /* lock-free account balances */
+  BANK_ENGINE_STM,     /* transactions on versioned account balances */
+} BankEngine;
+
 typedef struct Bank {
+  BankEngine engine;
+  LockKind lockKind;   /* of the account locks */
   unsigned int numberBranches;
   struct       Branch  *branches;
+  int          numberWorkers;
+  struct       BranchSeq *updateSeqs;  /* one per worker, see Branch_BeginUpdate */
+  _Atomic int  waitingReaders;         /* balance readers holding updates off */
   struct       Report  *report;
-  int finishedDay;
   pthread_mutex_t lock;
   pthread_cond_t cond;
 } Bank;
@@ -18,7 +33,10 @@ int Bank_Balance(Bank *bank, AccountAmount *balance);
 
 Bank *Bank_Init(int numBranches, int numAccounts, AccountAmount initAmount,
                 AccountAmount reportingAmount,
-                int numWorkers);
+                int numWorkers, BankEngine engine, AccountLayout layout,
+                LockKind lockKind);
+
+int Bank_ParseEngine(const char *name, BankEngine *engine);
 
 int Bank_Validate(Bank *bank);
 int Bank_Compare(Bank *bank1, Bank *bank2);
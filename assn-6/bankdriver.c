@@ -16,6 +16,7 @@
 #include "teller.h"
 #include "action.h"
 #include "report.h"
+#include "lock.h"
 #include "error.h"
 
 #include "debug.h"
@@ -28,6 +29,11 @@ int numWorkers = 1; /* by default no concurrency. */
 int testRunNum = 1; /* Default test is test 1. */
 int actionControl = 0; /* Control flags for the action generator. */
 unsigned int randSeed = 0;   /* Random number generator seed - Default is use time */
+BankEngine bankEngine = BANK_ENGINE_MUTEX; /* How the tellers synchronize. */
+AccountLayout accountLayout = ACCOUNT_LAYOUT_PACKED; /* How accounts sit in memory. */
+LockKind lockKind = LOCK_KIND_MUTEX; /* What the account locks are. */
+int batchSize = 1; /* Teller actions a worker runs at once (see Teller_DoBatch). */
+ActionScheduler actionScheduler = ACTION_SCHED_STATIC; /* How workers get actions. */
 Bank *bank;
 
 /*
@@ -40,11 +46,33 @@ static AccountAmount fixedBankBalance = 0;
 /* Number of errors detected per worker */
 static int workerBalanceErrors[MAX_WORKERS] = {0};
 
+/* Wrong answers to the checks of TestFailureCodes. */
+static int failureCodeErrors = 0;
+
+/*
+ * Time each worker spent waiting for the others: at the reports, and from
+ * running out of actions until the last worker was done.
+ */
+static int64_t workerIdleTime[MAX_WORKERS];
+static int64_t workerDoneTime[MAX_WORKERS];
+
+/* Transactions each worker committed and aborted with the STM engine. */
+static uint64_t workerStmCommits[MAX_WORKERS];
+static uint64_t workerStmAborts[MAX_WORKERS];
+
+/* Locks each worker took, found held, and waited for (see Lock_Stats). */
+static uint64_t workerLocksAcquired[MAX_WORKERS];
+static uint64_t workerLocksContended[MAX_WORKERS];
+static uint64_t workerLockWaitNanos[MAX_WORKERS];
+
 
 static Bank *CreateBank(int testRunNum, int numWorkers, unsigned int initSeed,
                         int verbose);
 static int MultipleWorkers(int numWorkers);
 static void *Worker(void *threadarg);
+static int BatchAction(Action *action, TellerOp *op);
+static void RunBatch(int workerNum, TellerOp *batch, int numBatched);
+static int TestFailureCodes(void);
 static void TestBank(int testRunNumber, unsigned int initSeed,
                      uint64_t totalTime);
 static int64_t  GetTimeInMicrosecs(void);
@@ -58,7 +86,7 @@ main(int argc, char *argv[])
   char *debugFlagArgs = nullString;
   int yieldpercent = 0;
 
-  while ((opt = getopt(argc, argv, "w:d:t:s:hfbry::")) != -1) {
+  while ((opt = getopt(argc, argv, "w:d:t:s:e:l:n:m:p:k:hfbry::")) != -1) {
     switch (opt) {
     case 'w':
       numWorkers = atoi(optarg);
@@ -69,6 +97,41 @@ main(int argc, char *argv[])
     case 's':
       randSeed = atoi(optarg);
       break;
+    case 'e':
+      if (Bank_ParseEngine(optarg, &bankEngine) < 0) {
+        fprintf(stderr, "Unknown engine -e%s\n", optarg);
+        PrintUsageAndExit(argv[0]);
+      }
+      break;
+    case 'l':
+      if (Account_ParseLayout(optarg, &accountLayout) < 0) {
+        fprintf(stderr, "Unknown account layout -l%s\n", optarg);
+        PrintUsageAndExit(argv[0]);
+      }
+      break;
+    case 'n':
+      batchSize = atoi(optarg);
+      if ((batchSize < 1) || (batchSize > TELLER_MAX_BATCH)) {
+        fprintf(stderr, "Invalid -n option (%s) must be 1-%d\n", optarg,
+                TELLER_MAX_BATCH);
+        PrintUsageAndExit(argv[0]);
+      }
+      break;
+    case 'm':
+      if (Action_ParseScheduler(optarg, &actionScheduler) < 0) {
+        fprintf(stderr, "Unknown scheduler -m%s\n", optarg);
+        PrintUsageAndExit(argv[0]);
+      }
+      break;
+    case 'p':
+      Report_SetBarrierSpin(atoi(optarg));
+      break;
+    case 'k':
+      if (Lock_ParseKind(optarg, &lockKind) < 0) {
+        fprintf(stderr, "Unknown lock kind -k%s\n", optarg);
+        PrintUsageAndExit(argv[0]);
+      }
+      break;
     case 'f':
       testfailurecode = 1;
       break;
@@ -98,15 +161,8 @@ main(int argc, char *argv[])
     }
   }
 
-  /* If we are using the repeatable random number generator we can only handle these */
-  if (!((numWorkers == 1) || (numWorkers == 2) || (numWorkers == 4) ||
-        (numWorkers == 8) ||
-        (numWorkers == 16))) {
-    fprintf(stderr, "Number of workers must be a 1,2,4,8 or 16\n");
-    PrintUsageAndExit(argv[0]);
-  }
-
   if ((numWorkers < 1) || (numWorkers > MAX_WORKERS)) {
+    fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_WORKERS);
     PrintUsageAndExit(argv[0]);
   }
 
@@ -132,8 +188,45 @@ main(int argc, char *argv[])
   uint64_t endTime = GetTimeInMicrosecs();
   uint64_t totalTime = (endTime - startTime);
 
-  printf("All workers done in %.02f seconds.\nComparing with sequential run ...\n",
-         totalTime/1000000.0);
+  printf("All workers done in %.02f seconds.\n", totalTime/1000000.0);
+  if (numWorkers > 1) {
+    printf("Worker idle seconds:");
+    for (int w = 0; w < numWorkers; w++) {
+      printf(" %.02f", (workerIdleTime[w] + endTime - workerDoneTime[w])/1000000.0);
+    }
+    printf("\n");
+  }
+  if (numWorkers > 1 && actionScheduler == ACTION_SCHED_STEAL) {
+    printf("Chunks stolen:");
+    for (int w = 0; w < numWorkers; w++) {
+      printf(" %d", Action_ChunksStolen(w));
+    }
+    printf("\n");
+  }
+  if (bankEngine == BANK_ENGINE_STM) {
+    uint64_t commits = 0, aborts = 0;
+    for (int w = 0; w < numWorkers; w++) {
+      commits += workerStmCommits[w];
+      aborts += workerStmAborts[w];
+    }
+    printf("STM transactions: %"PRIu64" committed, %"PRIu64" aborted (%.03f%%)\n",
+           commits, aborts, 100.0 * aborts / (commits + aborts ? commits + aborts : 1));
+  }
+  uint64_t acquired = 0, contended = 0, waitNanos = 0;
+  for (int w = 0; w < numWorkers; w++) {
+    acquired += workerLocksAcquired[w];
+    contended += workerLocksContended[w];
+    waitNanos += workerLockWaitNanos[w];
+  }
+  if (acquired > 0) {
+    printf("Locks: %"PRIu64" taken, %"PRIu64" found held (%.03f%%), "
+           "%.02f seconds waited\n", acquired, contended,
+           100.0 * contended / acquired, waitNanos / 1000000000.0);
+  }
+  if (testfailurecode) {
+    failureCodeErrors = TestFailureCodes();
+  }
+  printf("Comparing with sequential run ...\n");
 
   TestBank(testRunNum, randSeed, totalTime);
 
@@ -256,10 +349,10 @@ CreateBank(int testRunNum, int numWorkers, unsigned int initSeed, int verbose)
   }
   Action_Init(numBranches, numAccounts, numCommands, maxTransactionSize,
               numWorkers,
-              initSeed);
+              initSeed, actionScheduler);
 
   bank = Bank_Init(numBranches, numAccounts, initialAmount, reportingAmount,
-                   numWorkers);
+                   numWorkers, bankEngine, accountLayout, lockKind);
 
   if (testbankbalance) {
     int err = Bank_Balance(bank, &fixedBankBalance);
@@ -324,15 +417,40 @@ static void *Worker(void *threadarg)
   }
 
   DPRINTF('w', ("Worker(%d) starting\n", workerNum));
+  Branch_SetWorker(workerNum);
+
+  TellerOp batch[TELLER_MAX_BATCH];
+  int numBatched = 0;
 
   while (1) {
     Action action;
     int err = Action_GetNext(workerNum, &action, actionControl);
 
     if (err < 0) {
+      RunBatch(workerNum, batch, numBatched);
       break;
     }
 
+    /*
+     * With -n, deposits, withdrawals and transfers are collected and run
+     * as a batch once there are batchSize of them.  Balance queries don't
+     * wait for the batch: they may run concurrently with any teller action
+     * anyway.  The end of the day (a report) and the end of the run do.
+     */
+    if (batchSize > 1) {
+      if (BatchAction(&action, &batch[numBatched])) {
+        if (++numBatched == batchSize) {
+          RunBatch(workerNum, batch, numBatched);
+          numBatched = 0;
+        }
+        continue;
+      }
+      if (action.cmd == ACTION_REPORT || action.cmd == ACTION_DONE) {
+        RunBatch(workerNum, batch, numBatched);
+        numBatched = 0;
+      }
+    }
+
     DPRINTF('x', ("W%d:", workerNum));
 
     AccountAmount balance;
@@ -372,20 +490,13 @@ static void *Worker(void *threadarg)
 
       break;
     case ACTION_BRANCH_BALANCE:
-
-      if (action.u.branchArg.branchID < bank->numberBranches)
-        pthread_mutex_lock(&(bank->branches[action.u.branchArg.branchID].lock));
       err = Branch_Balance(bank,action.u.branchArg.branchID, &balance);
-      if (action.u.branchArg.branchID < bank->numberBranches)
-        pthread_mutex_unlock(&(bank->branches[action.u.branchArg.branchID].lock));
 
       DPRINTF('b', ("Branch %"PRIu64" balance is %"PRId64"\n",
                     action.u.branchArg.branchID, balance));
       break;
     case ACTION_BANK_BALANCE:
-      pthread_mutex_lock(&(bank->lock));
       err = Bank_Balance(bank, &balance);
-      pthread_mutex_unlock(&(bank->lock));
       DPRINTF('b', ("Bank balance is %"PRId64"\n", balance));
       if (testbankbalance && (fixedBankBalance != balance)) {
         numBalanceErrors++;
@@ -394,8 +505,10 @@ static void *Worker(void *threadarg)
 
       }
       break;
-    case ACTION_REPORT:
+    case ACTION_REPORT: {
+      int64_t reportStart = GetTimeInMicrosecs();
       err = Report_DoReport(bank, action.u.reportArg.workerNum);
+      workerIdleTime[workerNum] += GetTimeInMicrosecs() - reportStart;
       if (err != 0) {
         fprintf(stderr, "Report_DoReport(Worker=%d) returns %d\n",
                 action.u.reportArg.workerNum,
@@ -403,6 +516,7 @@ static void *Worker(void *threadarg)
         err = 0; // Mask error so we don't abort on a report error
       }
       break;
+    }
     default:
       fprintf(stderr, "Unknown action cmd %d\n", action.cmd);
       err = -1;
@@ -412,6 +526,10 @@ static void *Worker(void *threadarg)
 
   }
   workerBalanceErrors[workerNum] = numBalanceErrors;
+  workerDoneTime[workerNum] = GetTimeInMicrosecs();
+  Teller_StmStats(&workerStmCommits[workerNum], &workerStmAborts[workerNum]);
+  Lock_Stats(&workerLocksAcquired[workerNum], &workerLocksContended[workerNum],
+             &workerLockWaitNanos[workerNum]);
   DPRINTF('w', ("Worker(%d) exiting\n", workerNum));
   if (!noexit) {
     pthread_exit(NULL);
@@ -419,6 +537,132 @@ static void *Worker(void *threadarg)
   return NULL;
 }
 
+/*
+ * turn a deposit, withdrawal or transfer action into a teller operation.
+ * Returns 0 for the actions that can't be batched.
+ */
+static int
+BatchAction(Action *action, TellerOp *op)
+{
+  switch (action->cmd) {
+  case ACTION_DEPOSIT:
+    op->type = TELLER_DEPOSIT;
+    op->dstAccountNum = action->u.depwithArg.accountNum;
+    op->amount = action->u.depwithArg.amount;
+    return 1;
+  case ACTION_WITHDRAW:
+    op->type = TELLER_WITHDRAW;
+    op->srcAccountNum = action->u.depwithArg.accountNum;
+    op->amount = action->u.depwithArg.amount;
+    return 1;
+  case ACTION_TRANSFER:
+    op->type = TELLER_TRANSFER;
+    op->srcAccountNum = action->u.transArg.srcAccountNum;
+    op->dstAccountNum = action->u.transArg.dstAccountNum;
+    op->amount = action->u.transArg.amount;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * run the batched operations and report the ones that succeeded, just as
+ * Worker does for a single action.
+ */
+static void
+RunBatch(int workerNum, TellerOp *batch, int numBatched)
+{
+  if (numBatched == 0) {
+    return;
+  }
+  Teller_DoBatch(bank, batch, numBatched);
+  for (int i = 0; i < numBatched; i++) {
+    if (batch[i].result != ERROR_SUCCESS) {
+      continue;
+    }
+    if (batch[i].type != TELLER_DEPOSIT) {
+      Report_Transfer(bank, workerNum, batch[i].srcAccountNum, -batch[i].amount);
+    }
+    if (batch[i].type != TELLER_WITHDRAW) {
+      Report_Transfer(bank, workerNum, batch[i].dstAccountNum, batch[i].amount);
+    }
+  }
+}
+
+/*
+ * check what the tellers answer for operations of 0 on an overdrawn account
+ * of the kind -f sets up (see Account_Init): taking 0 out of it fails for
+ * lack of funds, as it always has, while putting 0 into it, or moving 0 from
+ * it to itself, succeeds.  Each case runs on its own and in a batch, and a
+ * Teller_DoMulti leg taking money out without its debit flag must fail too.
+ * None of them change a balance, so they run on the bank the workers are
+ * done with.  No other teller runs meanwhile, so they don't cover what
+ * other tellers see of a multi-leg operation under the atomic engine (see
+ * AtomicApplyNets).  Returns the number of wrong answers.
+ */
+static int
+TestFailureCodes(void)
+{
+  AccountNumber overdrawn = Account_MakeAccountNum(0, 0);
+  AccountNumber funded = Account_MakeAccountNum(0, 1);
+  struct {
+    TellerOp op;
+    int expected;
+  } cases[] = {
+    { { TELLER_TRANSFER, overdrawn, funded, 0, 0 }, ERROR_INSUFFICIENT_FUNDS },
+    { { TELLER_WITHDRAW, overdrawn, 0, 0, 0 }, ERROR_INSUFFICIENT_FUNDS },
+    { { TELLER_TRANSFER, overdrawn, overdrawn, 0, 0 }, ERROR_SUCCESS },
+    { { TELLER_TRANSFER, funded, overdrawn, 0, 0 }, ERROR_SUCCESS },
+    { { TELLER_DEPOSIT, 0, overdrawn, 0, 0 }, ERROR_SUCCESS },
+  };
+  int numCases = sizeof(cases) / sizeof(cases[0]);
+  TellerOp batch[sizeof(cases) / sizeof(cases[0])];
+  int errors = 0;
+
+  for (int i = 0; i < numCases; i++) {
+    TellerOp *op = &cases[i].op;
+    int err;
+    switch (op->type) {
+    case TELLER_DEPOSIT:
+      err = Teller_DoDeposit(bank, op->dstAccountNum, op->amount);
+      break;
+    case TELLER_WITHDRAW:
+      err = Teller_DoWithdraw(bank, op->srcAccountNum, op->amount);
+      break;
+    default:
+      err = Teller_DoTransfer(bank, op->srcAccountNum, op->dstAccountNum,
+                              op->amount);
+      break;
+    }
+    if (err != cases[i].expected) {
+      fprintf(stderr, "Failure code case %d returned %d, expected %d\n",
+              i, err, cases[i].expected);
+      errors++;
+    }
+    batch[i] = *op;
+  }
+
+  Teller_DoBatch(bank, batch, numCases);
+  for (int i = 0; i < numCases; i++) {
+    if (batch[i].result != cases[i].expected) {
+      fprintf(stderr, "Failure code case %d returned %d in a batch, "
+              "expected %d\n", i, batch[i].result, cases[i].expected);
+      errors++;
+    }
+  }
+
+  /* a leg that takes money out is a debit, whatever its flag says */
+  TellerLeg unflagged[2] = { { overdrawn, -1, 0 }, { funded, 1, 0 } };
+  int err = Teller_DoMulti(bank, unflagged, 2);
+  if (err != ERROR_INSUFFICIENT_FUNDS) {
+    fprintf(stderr, "Failure code check of an unflagged debit leg returned "
+            "%d, expected %d\n", err, ERROR_INSUFFICIENT_FUNDS);
+    errors++;
+  }
+  return errors;
+}
+
 /*
  * test the data in the bank after all workers are done.
  */
@@ -436,6 +680,9 @@ TestBank(int testRunNumber, unsigned int initSeed, uint64_t totalTime)
     fprintf(stderr, "%d bank balance command errors detected.\n", 
             balanceCmdErrors);
   }
+  if (failureCodeErrors) {
+    fprintf(stderr, "%d failure code checks failed.\n", failureCodeErrors);
+  }
     
   bank =  CreateBank(testRunNumber, 1, initSeed, 0);
 
@@ -447,7 +694,7 @@ TestBank(int testRunNumber, unsigned int initSeed, uint64_t totalTime)
   uint64_t endTime = GetTimeInMicrosecs();
 
   int err = Bank_Compare(bank, bankmulti);
-  if ((err < 0) || balanceCmdErrors) {
+  if ((err < 0) || balanceCmdErrors || failureCodeErrors) {
     fprintf(stderr,"Bank testrun %d compare FAILED. Time ratio %.02f\n",
             testRunNumber,
             (double)totalTime/(double)(endTime - startTime));
@@ -485,7 +732,7 @@ PrintUsageAndExit(char *progname)
     const char *usage =
         "Usage: %s <options>\n"
         "where <options> can be:\n"
-        "  -wN        Use N workers. N must be 1, 2, 4, 8, or 16.\n"
+        "  -wN        Use N workers, 1 to 256.\n"
         "  -tN        Run test N, where N is 1-7. Each test varies bank\n"
         "             parameters such as number of branches, accounts, and\n"
         "             commands, and maximum transaction amount. See CreateBank\n"
@@ -502,6 +749,28 @@ PrintUsageAndExit(char *progname)
         "  -sN        Seed the random number generator with N. If no -s argument\n"
         "             is included, or -s0 is used, the seed will be based on the\n"
         "             clock.\n"
+        "  -eENGINE   Keep balances consistent with ENGINE: mutex (the default)\n"
+        "             locks each account, atomic updates balances with\n"
+        "             atomic instructions and takes no locks, stm runs every\n"
+        "             operation as a transaction on versioned balances that\n"
+        "             retries when another one commits first.\n"
+        "  -lLAYOUT   Lay the accounts of a branch out in memory as LAYOUT:\n"
+        "             packed (the default) back to back, padded one per cache\n"
+        "             line, or split with the balances in an array of their own.\n"
+        "  -nN        Run deposits, withdrawals and transfers in batches of\n"
+        "             up to N (at most 256), locking each account once per\n"
+        "             batch. The default, 1, runs them one at a time.\n"
+        "  -mSCHED    Hand out the actions with scheduler SCHED: static (the\n"
+        "             default) gives every worker a fixed share of each day,\n"
+        "             steal puts them in per-worker deques of chunks and lets\n"
+        "             idle workers steal. Both print each worker's idle time.\n"
+        "  -pN        At the end of a day, check N times whether the other\n"
+        "             workers are done before going to sleep (default 1000;\n"
+        "             0 sleeps at once).\n"
+        "  -kKIND     Make the account locks of kind KIND: mutex (the\n"
+        "             default), spin (spins a while before it sleeps) or\n"
+        "             ticket (waiters spin and are served in order). Prints\n"
+        "             how often the locks were found held.\n"
         "  -f         Initialize the bank such that some transfers are\n"
         "             guaranteed to fail.\n"
         "  -h         Print this help message.\n";
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Times bankdriver over a grid of tests, worker counts and option variants,
+# and checks that every run still passes the compare with the sequential run.
+#
+# usage: ./bench.sh [-t "<tests>"] [-w "<worker counts>"] [-v "<variants>"] [-s <seed>]
+#
+# Each variant is one set of extra bankdriver options, with the options of a
+# set joined by commas, e.g. -v "-emutex -eatomic" compares the two engines,
+# and -v "-emutex,-b -eatomic,-b" does the same with balance checks on.
+# The table shows the seconds the workers took (the "All workers done"
+# line), with a "!" after runs that failed the compare.
+
+TESTS="1 2 3 4 5 6 7"
+WORKERS="1 2 4 8 16"
+VARIANTS="-emutex"
+SEED=1
+
+while getopts "t:w:v:s:" opt; do
+  case $opt in
+    t) TESTS=$OPTARG ;;
+    w) WORKERS=$OPTARG ;;
+    v) VARIANTS=$OPTARG ;;
+    s) SEED=$OPTARG ;;
+    *) sed -n '3,13p' "$0"; exit 1 ;;
+  esac
+done
+
+printf "%-5s %-24s" test variant
+for w in $WORKERS; do printf " %8s" "w$w"; done
+printf "\n"
+
+STATUS=0
+for t in $TESTS; do
+  for v in $VARIANTS; do
+    printf "%-5s %-24s" "t$t" "$v"
+    for w in $WORKERS; do
+      OUT=$(./bankdriver -t"$t" -w"$w" -s"$SEED" $(echo "$v" | tr ',' ' ') 2>&1)
+      SECS=$(echo "$OUT" | sed -n 's/^All workers done in \([0-9.]*\) seconds.*/\1/p')
+      if echo "$OUT" | grep -q "PASSED"; then
+        printf " %8s" "$SECS"
+      else
+        printf " %7s!" "${SECS:-?}"
+        STATUS=1
+      fi
+    done
+    printf "\n"
+  done
+done
+exit $STATUS
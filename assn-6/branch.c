@@ -5,6 +5,7 @@
 #include <inttypes.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include "teller.h"
 #include "account.h"
@@ -14,12 +15,24 @@
 
 #include "branch.h"
 
+/*
+ * How many times a balance reader reads optimistically before it holds
+ * off new updates to get its snapshot (see SnapshotSum).
+ */
+#define SNAPSHOT_TRIES 16
+
+/* The worker running on this thread, which picks its branch deltas. */
+static _Thread_local int currentWorker = 0;
+
+/* Whether this thread is between Branch_BeginUpdate and Branch_EndUpdate. */
+static _Thread_local int inUpdate = 0;
+
 /*
  * allocate and initialize each branch.
  */
 int
 Branch_Init(Bank *bank, int numBranches, int numAccounts,
-            AccountAmount initialAmount)
+            AccountAmount initialAmount, int numWorkers, AccountLayout layout)
 {
   bank->numberBranches = numBranches;
   bank->branches = malloc(numBranches * sizeof(Branch));
@@ -27,23 +40,60 @@ Branch_Init(Bank *bank, int numBranches, int numAccounts,
     return -1;
   }
 
+  bank->numberWorkers = numWorkers;
+  bank->updateSeqs = aligned_alloc(CACHE_LINE_SIZE, numWorkers * sizeof(BranchSeq));
+  if (bank->updateSeqs == NULL) {
+    return -1;
+  }
+  for (int w = 0; w < numWorkers; w++) {
+    atomic_init(&bank->updateSeqs[w].count, 0);
+    atomic_init(&bank->updateSeqs[w].total, 0);
+  }
+
   int accountsPerBranch = numAccounts /  numBranches;
 
   for (int i = 0; i < numBranches; i++) {
     Branch *branch = &bank->branches[i];
 
-    pthread_mutex_init(&(branch->lock), NULL);
     branch->branchID = i;
-    branch->balance = 0;
+    branch->initialBalance = 0;
     branch->numberAccounts = accountsPerBranch;
-    branch->accounts = (Account *) malloc(accountsPerBranch * sizeof(Account));
+    branch->states = NULL;
+    if (layout == ACCOUNT_LAYOUT_PADDED) {
+      branch->accountStride = (sizeof(Account) + sizeof(AccountState) +
+                               CACHE_LINE_SIZE - 1) /
+                              CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+      branch->accounts = aligned_alloc(CACHE_LINE_SIZE,
+                                       accountsPerBranch * branch->accountStride);
+    } else if (layout == ACCOUNT_LAYOUT_SPLIT) {
+      branch->accountStride = sizeof(Account);
+      branch->accounts = malloc(accountsPerBranch * branch->accountStride);
+      branch->states = malloc(accountsPerBranch * sizeof(AccountState));
+      if (branch->states == NULL) {
+        return -1;
+      }
+    } else {
+      branch->accountStride = sizeof(Account) + sizeof(AccountState);
+      branch->accounts = malloc(accountsPerBranch * branch->accountStride);
+    }
     if (branch->accounts == NULL) {
       return -1;
     }
+    branch->numberDeltas = numWorkers;
+    branch->deltas = aligned_alloc(CACHE_LINE_SIZE,
+                                   numWorkers * sizeof(BranchDelta));
+    if (branch->deltas == NULL) {
+      return -1;
+    }
+    for (int w = 0; w < numWorkers; w++) {
+      atomic_init(&branch->deltas[w].amount, 0);
+    }
 
     for (int a = 0; a < accountsPerBranch; a++) {
-      Account_Init(bank, &branch->accounts[a], a, i, initialAmount);
-      branch->balance += branch->accounts[a].balance;
+      Account *account = Branch_Account(branch, a);
+      Account_Init(bank, account, a, i, initialAmount,
+                   branch->states ? &branch->states[a] : NULL);
+      branch->initialBalance += account->state->balance;
     }
   }
 
@@ -51,7 +101,154 @@ Branch_Init(Bank *bank, int numBranches, int numAccounts,
 }
 
 /*
- * update the balance of a branch.
+ * tell the branch module which worker is running on the calling thread.
+ * Every worker thread must call this before it makes any transaction.
+ */
+void
+Branch_SetWorker(int workerNum)
+{
+  currentWorker = workerNum;
+}
+
+/*
+ * start an update of the calling worker that changes the balances of
+ * more than one branch, so that balance readers see all of its changes or
+ * none of them.  Until the matching Branch_EndUpdate, readers will wait for
+ * (or retry after) this worker.  A lone Branch_UpdateBalance is an update
+ * of its own.  While a reader has run out of optimistic tries, the update
+ * waits for it to finish first.
+ */
+void
+Branch_BeginUpdate(Bank *bank)
+{
+  _Atomic unsigned int *count =
+    &bank->updateSeqs[currentWorker % bank->numberWorkers].count;
+  while (atomic_load_explicit(&bank->waitingReaders, memory_order_acquire) > 0) {
+    sched_yield();
+  }
+  atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  inUpdate = 1;
+}
+
+/*
+ * finish the update started by Branch_BeginUpdate.
+ */
+void
+Branch_EndUpdate(Bank *bank)
+{
+  _Atomic unsigned int *count =
+    &bank->updateSeqs[currentWorker % bank->numberWorkers].count;
+  inUpdate = 0;
+  atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
+
+/*
+ * add up the update counts of all workers.  Returns -1 if one of them is
+ * in the middle of an update.  A count only ever goes up, so the sum is
+ * the same at two moments only if no worker updated anything in between.
+ */
+static int64_t
+SumCounts(Bank *bank, memory_order order)
+{
+  int64_t sum = 0;
+  for (int w = 0; w < bank->numberWorkers; w++) {
+    unsigned int count = atomic_load_explicit(&bank->updateSeqs[w].count, order);
+    if (count & 1) {
+      return -1;
+    }
+    sum += count;
+  }
+  return sum;
+}
+
+/*
+ * get the sum of the initial balances of all branches.
+ */
+AccountAmount
+Branch_InitialTotal(Bank *bank)
+{
+  AccountAmount total = 0;
+  for (unsigned int b = 0; b < bank->numberBranches; b++) {
+    total += bank->branches[b].initialBalance;
+  }
+  return total;
+}
+
+/*
+ * sum the initial balance and the deltas of all workers.
+ */
+static AccountAmount
+SumDeltas(Branch *branch)
+{
+  AccountAmount total = branch->initialBalance;
+  for (int w = 0; w < branch->numberDeltas; w++) {
+    total += atomic_load_explicit(&branch->deltas[w].amount,
+                                  memory_order_relaxed);
+  }
+  return total;
+}
+
+/*
+ * sum the worker totals of the bank, or the deltas of one branch if branch
+ * isn't NULL, as a snapshot: the counts of all workers are even and add up
+ * to the same before and after the sum is read, so no worker changed
+ * anything meanwhile and every value read was there at the moment the
+ * first read of the counts ended.  If one of the workers was updating, the
+ * sum is read again.  After SNAPSHOT_TRIES reads the reader counts itself
+ * in waitingReaders, so that no new update starts (see Branch_BeginUpdate)
+ * and the next read that finds no update in progress succeeds.
+ */
+static AccountAmount
+SnapshotSum(Bank *bank, Branch *branch)
+{
+  int tries = 0;
+  while (1) {
+    if (++tries == SNAPSHOT_TRIES) {
+      atomic_fetch_add_explicit(&bank->waitingReaders, 1, memory_order_seq_cst);
+    }
+    int64_t before = SumCounts(bank, memory_order_acquire);
+    if (before < 0) {
+      sched_yield();
+      continue;
+    }
+    AccountAmount total = 0;
+    if (branch != NULL) {
+      total = SumDeltas(branch);
+    } else {
+      for (int w = 0; w < bank->numberWorkers; w++) {
+        total += atomic_load_explicit(&bank->updateSeqs[w].total,
+                                      memory_order_relaxed);
+      }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (SumCounts(bank, memory_order_relaxed) == before) {
+      if (tries >= SNAPSHOT_TRIES) {
+        atomic_fetch_sub_explicit(&bank->waitingReaders, 1, memory_order_release);
+      }
+      return total;
+    }
+  }
+}
+
+/*
+ * get the sum of the changes all workers have made to all branches, as one
+ * snapshot (see SnapshotSum).
+ */
+AccountAmount
+Branch_DeltaTotal(Bank *bank)
+{
+  return SnapshotSum(bank, NULL);
+}
+
+/*
+ * update the balance of a branch.  The change goes into the calling
+ * worker's own delta and total, which no other thread writes, so a plain
+ * load and store is enough whatever the engine and no lock is
+ * needed.  Outside of Branch_BeginUpdate and Branch_EndUpdate, the change
+ * is an update of its own.
  */
 int
 Branch_UpdateBalance(Bank *bank, BranchID branchID, AccountAmount change)
@@ -60,8 +257,22 @@ Branch_UpdateBalance(Bank *bank, BranchID branchID, AccountAmount change)
   if (branchID >= bank->numberBranches) {
     return -1;
   }
-  AccountAmount oldBalance = bank->branches[branchID].balance; Y;
-  bank->branches[branchID].balance = oldBalance + change; Y;
+  Branch *branch = &bank->branches[branchID];
+  _Atomic AccountAmount *delta =
+    &branch->deltas[currentWorker % branch->numberDeltas].amount;
+  _Atomic AccountAmount *total =
+    &bank->updateSeqs[currentWorker % bank->numberWorkers].total;
+  int ownUpdate = !inUpdate;
+  if (ownUpdate) {
+    Branch_BeginUpdate(bank);
+  }
+  AccountAmount oldDelta = atomic_load_explicit(delta, memory_order_relaxed); Y;
+  atomic_store_explicit(delta, oldDelta + change, memory_order_relaxed); Y;
+  atomic_store_explicit(total, atomic_load_explicit(total, memory_order_relaxed)
+                        + change, memory_order_relaxed);
+  if (ownUpdate) {
+    Branch_EndUpdate(bank);
+  }
 
   return 0;
 }
@@ -79,7 +290,7 @@ Branch_Balance(Bank *bank, BranchID branchID, AccountAmount *balance)
     return -1;
   }
   
-  *balance = bank->branches[branchID].balance;  Y;
+  *balance = SnapshotSum(bank, &bank->branches[branchID]);  Y;
   /* It should be the case that the balance of a branch matches the sum 
    * of all the accounts in the branch.  The following routine validates 
    * this assumption but is far too expense to run in normal operation. 
@@ -106,13 +317,14 @@ Branch_Validate(Bank *bank, BranchID branchID)
   AccountAmount total = 0;
 
   for (int a = 0; a < branch->numberAccounts; a++) {
-    total += branch->accounts[a].balance;
+    total += Branch_Account(branch, a)->state->balance;
   }
 
-  if (total != branch->balance) {
+  AccountAmount stored = SumDeltas(branch);
+  if (total != stored) {
     fprintf(stderr, "Branch balance mismatch. "
             "Computer value is %"PRId64", but stored value is %"PRId64"\n",
-            total, branch->balance);
+            total, stored);
     return -1;
   }
 
@@ -139,27 +351,33 @@ Branch_Compare(Branch *branch1, Branch *branch2)
     err = -1;
   }
 
-  if (branch1->balance != branch2->balance) {
+  AccountAmount balance1 = SumDeltas(branch1);
+  AccountAmount balance2 = SumDeltas(branch2);
+  if (balance1 != balance2) {
     fprintf(stderr, "Branches %"PRIu64" and %"PRIu64" mismatch in balance "
             "(%"PRId64" and %"PRId64", respectively).\n",
             branch1ID, branch2ID,
-            branch1->balance, branch2->balance);
+            balance1, balance2);
     err = -1;
   }
 
   for (int i = 0; i < branch1->numberAccounts; i++) {
 
-    assert(branch1->accounts[i].accountNumber ==
-           branch2->accounts[i].accountNumber);
+    Account *account1 = Branch_Account(branch1, i);
+    Account *account2 = Branch_Account(branch2, i);
+    AccountAmount accountBalance1 = account1->state->balance;
+    AccountAmount accountBalance2 = account2->state->balance;
+
+    assert(account1->accountNumber == account2->accountNumber);
 
-    if (branch1->accounts[i].balance != branch2->accounts[i].balance) {
+    if (accountBalance1 != accountBalance2) {
       fprintf(stderr,
               "Branch %"PRIu64" and %"PRIu64" mismatch in account 0x%"PRIx64" balance "
               "(%"PRId64" and %"PRId64", respectively).\n",
               branch1ID, branch2ID,
-              branch1->accounts[i].accountNumber,
-              branch1->accounts[i].balance,
-              branch2->accounts[i].balance);
+              account1->accountNumber,
+              accountBalance1,
+              accountBalance2);
       err = -1;
     }
   }
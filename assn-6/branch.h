@@ -4,29 +4,80 @@
 #include <stdint.h>
 #include <pthread.h>
 
+#include "lock.h"
+
 
 typedef uint64_t BranchID;
 
+#define CACHE_LINE_SIZE 64
+
+/*
+ * The changes a single worker has made to the balance of a branch.  Only
+ * that worker ever writes it, and it has a cache line to itself, so
+ * updating it never contends with other workers.
+ */
+typedef struct BranchDelta {
+  _Alignas(CACHE_LINE_SIZE) _Atomic AccountAmount amount;
+} BranchDelta;
+
+/*
+ * Sequence count of one worker's updates to the branch balances, and the
+ * sum of all its deltas.  The count is odd while the worker is in the
+ * middle of an update, and goes up by two with every one, whether it
+ * touches one branch or several (a cross-branch transfer).  Balance readers
+ * check the counts of all workers before and after they read, so what they
+ * read was all there at one moment (see Branch_DeltaTotal).  Only the worker
+ * itself writes its count and total, so they get a cache line of their own
+ * like the deltas.
+ */
+typedef struct BranchSeq {
+  _Alignas(CACHE_LINE_SIZE) _Atomic unsigned int count;
+  _Atomic AccountAmount total;
+} BranchSeq;
+
+/*
+ * The balance of a branch is not stored as such: it is initialBalance
+ * plus the deltas of all workers, summed on demand by Branch_Balance.
+ */
 typedef struct Branch {
   BranchID branchID;
-  AccountAmount balance;
+  AccountAmount initialBalance;
   int numberAccounts;
-  Account   *accounts;
-  pthread_mutex_t lock;
+  Account   *accounts;     /* accountStride bytes apart; see Branch_Account */
+  size_t accountStride;
+  AccountState *states;    /* with the split layout only */
+  int numberDeltas;
+  BranchDelta *deltas;     /* one per worker */
 } Branch;
 
 
 int Branch_Balance(struct Bank *bank, BranchID branchID, AccountAmount *balance);
 int Branch_UpdateBalance(struct Bank *bank, BranchID branchID,
                          AccountAmount change);
+void Branch_SetWorker(int workerNum);
+void Branch_BeginUpdate(struct Bank *bank);
+void Branch_EndUpdate(struct Bank *bank);
+AccountAmount Branch_InitialTotal(struct Bank *bank);
+AccountAmount Branch_DeltaTotal(struct Bank *bank);
 
 
 int Branch_Init(struct Bank *bank, int numBranches, int numAccounts,
-                AccountAmount initialAmount);
+                AccountAmount initialAmount, int numWorkers,
+                AccountLayout layout);
 
 int Branch_Validate(struct Bank *bank, BranchID branchID);
 int Branch_Compare(Branch *branch1, Branch *branch2);
 BranchID AccountNum_GetBranchID(AccountNumber accountNum);
 
 
+/*
+ * get the account at the given index of the branch.  How far apart the
+ * accounts are depends on the layout, so never index branch->accounts.
+ */
+static inline Account *
+Branch_Account(Branch *branch, int index)
+{
+  return (Account *) ((char *) branch->accounts + index * branch->accountStride);
+}
+
 #endif /* _BRANCH_H */
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "lock.h"
+
+/*
+ * How many times a spin lock tries again before it sleeps, and a ticket
+ * lock checks its turn before it gives up the processor for a while.
+ */
+#define LOCK_SPIN 100
+
+/*
+ * What the locks of this worker went through: how many times it took one,
+ * how many of those it found the lock held, and how long it waited then.
+ */
+static _Thread_local struct {
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t waitNanos;
+} lockStats;
+
+static uint64_t
+NowInNanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * initialize a lock of the given kind.
+ */
+void
+Lock_Init(Lock *lock, LockKind kind)
+{
+  lock->kind = kind;
+  switch (kind) {
+  case LOCK_KIND_MUTEX:
+  case LOCK_KIND_SPIN:
+    pthread_mutex_init(&(lock->u.mutex), NULL);
+    break;
+  case LOCK_KIND_TICKET:
+    atomic_init(&lock->u.ticket.next, 0);
+    atomic_init(&lock->u.ticket.serving, 0);
+    break;
+  }
+}
+
+/*
+ * wait for the lock, which was held when we tried it.
+ */
+static void
+WaitForLock(Lock *lock, uint32_t ticket)
+{
+  uint64_t start = NowInNanos();
+  lockStats.contended++;
+
+  switch (lock->kind) {
+  case LOCK_KIND_MUTEX:
+    pthread_mutex_lock(&(lock->u.mutex));
+    break;
+  case LOCK_KIND_SPIN: {
+    int spin = 0;
+    while (spin < LOCK_SPIN && pthread_mutex_trylock(&(lock->u.mutex)) != 0) {
+      spin++;
+    }
+    if (spin == LOCK_SPIN) {
+      pthread_mutex_lock(&(lock->u.mutex));
+    }
+    break;
+  }
+  case LOCK_KIND_TICKET:
+    for (int spin = 1;
+         atomic_load_explicit(&lock->u.ticket.serving,
+                              memory_order_acquire) != ticket;
+         spin++) {
+      if (spin % LOCK_SPIN == 0) {
+        sched_yield();
+      }
+    }
+    break;
+  }
+
+  lockStats.waitNanos += NowInNanos() - start;
+}
+
+/*
+ * take the lock for ourselves alone.
+ */
+void
+Lock_Acquire(Lock *lock)
+{
+  lockStats.acquired++;
+
+  switch (lock->kind) {
+  case LOCK_KIND_MUTEX:
+  case LOCK_KIND_SPIN:
+    if (pthread_mutex_trylock(&(lock->u.mutex)) != 0) {
+      WaitForLock(lock, 0);
+    }
+    break;
+  case LOCK_KIND_TICKET: {
+    uint32_t ticket = atomic_fetch_add_explicit(&lock->u.ticket.next, 1,
+                                                memory_order_relaxed);
+    if (atomic_load_explicit(&lock->u.ticket.serving,
+                             memory_order_acquire) != ticket) {
+      WaitForLock(lock, ticket);
+    }
+    break;
+  }
+  }
+}
+
+/*
+ * let go of a lock taken with Lock_Acquire.
+ */
+void
+Lock_Release(Lock *lock)
+{
+  switch (lock->kind) {
+  case LOCK_KIND_MUTEX:
+  case LOCK_KIND_SPIN:
+    pthread_mutex_unlock(&(lock->u.mutex));
+    break;
+  case LOCK_KIND_TICKET:
+    atomic_store_explicit(&lock->u.ticket.serving,
+                          atomic_load_explicit(&lock->u.ticket.serving,
+                                               memory_order_relaxed) + 1,
+                          memory_order_release);
+    break;
+  }
+}
+
+/*
+ * get the lock statistics of the calling worker: the number of locks it
+ * took, how many of them it found held, and the nanoseconds it waited for
+ * those.
+ */
+void
+Lock_Stats(uint64_t *acquired, uint64_t *contended, uint64_t *waitNanos)
+{
+  *acquired = lockStats.acquired;
+  *contended = lockStats.contended;
+  *waitNanos = lockStats.waitNanos;
+}
+
+/*
+ * look up the lock kind with the given name ("mutex", "spin" or "ticket").
+ * Returns -1 if there is no such kind, 0 otherwise.
+ */
+int
+Lock_ParseKind(const char *name, LockKind *kind)
+{
+  static const struct {
+    const char *name;
+    LockKind kind;
+  } kinds[] = {
+    { "mutex",  LOCK_KIND_MUTEX },
+    { "spin",   LOCK_KIND_SPIN },
+    { "ticket", LOCK_KIND_TICKET },
+  };
+
+  for (unsigned int k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    if (strcmp(name, kinds[k].name) == 0) {
+      *kind = kinds[k].kind;
+      return 0;
+    }
+  }
+  return -1;
+}
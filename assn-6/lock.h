@@ -0,0 +1,44 @@
+#ifndef _LOCK_H
+#define _LOCK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+
+/*
+ * The kinds of lock the account locks can be.
+ */
+typedef enum {
+  LOCK_KIND_MUTEX,   /* a default pthread mutex */
+  LOCK_KIND_SPIN,    /* a mutex that spins a while before it sleeps */
+  LOCK_KIND_TICKET,  /* a ticket lock: waiters spin and get it first come,
+                      * first served */
+} LockKind;
+
+/*
+ * A lock of any kind.  Only the member of u that matches kind is used.
+ */
+typedef struct Lock {
+  LockKind kind;
+  union {
+    pthread_mutex_t mutex;
+    struct {
+      _Atomic uint32_t next;     /* the ticket the next locker draws */
+      _Atomic uint32_t serving;  /* the ticket that holds the lock */
+    } ticket;
+  } u;
+} Lock;
+
+
+void Lock_Init(Lock *lock, LockKind kind);
+
+void Lock_Acquire(Lock *lock);
+
+void Lock_Release(Lock *lock);
+
+void Lock_Stats(uint64_t *acquired, uint64_t *contended, uint64_t *waitNanos);
+
+int Lock_ParseKind(const char *name, LockKind *kind);
+
+#endif /* _LOCK_H */
@@ -2,7 +2,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include <pthread.h>
 
@@ -16,26 +18,49 @@
 
 
 #define MAX_NUM_REPORTS 8       // Maximum number of reports we can store.
-#define MAX_LOG_ENTRIES 1024    // Maximum number of transfer records we can store per report.
+#define MIN_LOG_ENTRIES 64      // Transfer records a worker log starts out with room for.
+
+struct TransferLog {       // The transfer log contains the accountNum and transfer size
+  AccountNumber accountNum;
+  AccountAmount transferSize;
+};
+
+/*
+ * What the report module keeps for each worker: the transfers the worker
+ * recorded since the last report, its part of the bank balance at the
+ * report, and its sense of the day barrier.  Only the worker itself
+ * appends to its log, so appending takes no lock; the log is merged into
+ * the day's report by Report_DoReport, while every worker waits there.
+ * Each worker gets a cache line of its own so that workers appending to
+ * their logs don't write to a line another worker is using.
+ */
+typedef struct WorkerReport {
+  _Alignas(CACHE_LINE_SIZE) int numLogEntries;
+  int maxLogEntries;
+  struct TransferLog *transferLog;
+  AccountAmount partialBalance;   // Balance of the worker's slice of the branches
+  int sense;                      // Sense of the barrier the worker waits for
+} WorkerReport;
 
 typedef struct Report {
   int numReports;          // Number of complete reports filled in
   struct {                 // A report consist of:
     AccountAmount balance; //       The overall bank balance at the report time
-    int hasOverflowed;     //       Overflow state - 0 if transfer log hasn't overflowed, 1 otherwise
     int numLogEntries;     //       The number of entries in the log
-    struct TransferLog {               // The transfer log contains the accountNum and transfer size
-      AccountNumber accountNum;
-      AccountAmount transferSize;
-    } transferLog[MAX_LOG_ENTRIES];
-    pthread_mutex_t lock;
+    struct TransferLog *transferLog;   // The log, merged from the worker logs
   } dailyData[MAX_NUM_REPORTS];
-  pthread_mutex_t lock;
+  int numWorkerLogs;
+  WorkerReport *workerLogs;   // One per worker, for the current report period
+  int dayError;               // Error of the report in progress
+  _Atomic int arrived;        // Workers at the barrier (see BarrierWait)
+  _Atomic int sense;          // Flips each time the barrier opens
+  pthread_mutex_t lock;       // Lock and condition workers park on at the barrier
   pthread_cond_t cond;
 } Report;
 
 static AccountAmount reportingAmount;   // Reporting threshold amount
 static int numWorkers;                  // Number of worker threads in the system
+static int barrierSpin = 1000;          // Times to check the barrier before parking
  
 /*
  * Initialize the Report module of a bank.  Returns -1 on an error, 0 otherwise.
@@ -53,10 +78,30 @@ Report_Init(Bank *bank, AccountAmount reportAmount, int maxNumWorkers)
   bank->report->numReports = 0;
 
   for (int r = 0; r < MAX_NUM_REPORTS; r++) {
-    pthread_mutex_init(&(bank->report->dailyData[r].lock), NULL);
-    bank->report->dailyData[r].hasOverflowed = 0;
     bank->report->dailyData[r].numLogEntries = 0;
+    bank->report->dailyData[r].transferLog = NULL;
+  }
+
+  bank->report->numWorkerLogs = maxNumWorkers;
+  bank->report->workerLogs = aligned_alloc(CACHE_LINE_SIZE,
+                                           maxNumWorkers * sizeof(WorkerReport));
+  if (bank->report->workerLogs == NULL) {
+    return -1;
+  }
+  for (int w = 0; w < maxNumWorkers; w++) {
+    WorkerReport *log = &bank->report->workerLogs[w];
+    log->numLogEntries = 0;
+    log->maxLogEntries = MIN_LOG_ENTRIES;
+    log->transferLog = malloc(MIN_LOG_ENTRIES * sizeof(struct TransferLog));
+    if (log->transferLog == NULL) {
+      return -1;
+    }
+    log->partialBalance = 0;
+    log->sense = 0;
   }
+  bank->report->dayError = 0;
+  atomic_init(&bank->report->arrived, 0);
+  atomic_init(&bank->report->sense, 0);
 
   pthread_mutex_init(&(bank->report->lock), NULL);
   pthread_cond_init(&(bank->report->cond), NULL);
@@ -93,26 +138,144 @@ Report_Transfer(Bank *bank, int workerNum, AccountNumber accountNum,
       return 0;
   }
 
-  pthread_mutex_lock(&(rpt->dailyData[r].lock));
-  if (rpt->dailyData[r].numLogEntries >= MAX_LOG_ENTRIES) {
-    // Current report is full, mark it as overflowed and return.
-    rpt->dailyData[r].hasOverflowed = 1;
-    pthread_mutex_unlock(&(rpt->dailyData[r].lock));
-    return 0;
+  WorkerReport *log = &rpt->workerLogs[workerNum];
+  if (log->numLogEntries == log->maxLogEntries) {
+    // The log is full; double it.
+    struct TransferLog *bigger = realloc(log->transferLog,
+                                         2 * log->maxLogEntries * sizeof(struct TransferLog));
+    if (bigger == NULL) {
+      return -1;
+    }
+    log->transferLog = bigger;
+    log->maxLogEntries *= 2;
+  }
+  // Add the record to the end of the worker's log of records.
+  int ent = log->numLogEntries; Y;
+  log->transferLog[ent].accountNum = accountNum; Y;
+  log->transferLog[ent].transferSize = amount;   Y;
+  log->numLogEntries = ent + 1; Y;
+
+  return 0;
+}
+
+/*
+ * Set how many times a worker checks whether the day barrier has opened
+ * before it goes to sleep on the condition variable.  0 sleeps at once.
+ */
+void
+Report_SetBarrierSpin(int spins)
+{
+  barrierSpin = spins;
+}
+
+/*
+ * Sense-reversing barrier for all the workers.  Every worker flips its own
+ * sense and counts itself in; the last one to arrive runs serial(bank)
+ * while the others wait, then opens the barrier by setting the shared sense
+ * to its own.  Waiting workers check the shared sense barrierSpin times and
+ * then park on the condition variable; the last worker sets the sense under
+ * the lock before broadcasting, so a worker can't park after the wakeup.
+ * Returns what serial returned to the last worker, 0 to the others.
+ */
+static int
+BarrierWait(Bank *bank, int workerNum, int (*serial)(Bank *bank))
+{
+  Report *rpt = bank->report;
+  int mySense = !rpt->workerLogs[workerNum].sense;
+  rpt->workerLogs[workerNum].sense = mySense;
+
+  if (atomic_fetch_add(&rpt->arrived, 1) == numWorkers - 1) {
+    int err = (serial != NULL) ? serial(bank) : 0; Y;
+    atomic_store_explicit(&rpt->arrived, 0, memory_order_relaxed);
+    pthread_mutex_lock(&(rpt->lock));
+    atomic_store_explicit(&rpt->sense, mySense, memory_order_release);
+    pthread_cond_broadcast(&(rpt->cond));
+    pthread_mutex_unlock(&(rpt->lock));
+    return err;
   }
-  // Add the record to the end of the log of records.
-  int ent = rpt->dailyData[r].numLogEntries; Y;
-  rpt->dailyData[r].transferLog[ent].accountNum = accountNum; Y;
-  rpt->dailyData[r].transferLog[ent].transferSize = amount;   Y;
-  rpt->dailyData[r].numLogEntries = ent + 1; Y;
-  pthread_mutex_unlock(&(rpt->dailyData[r].lock));
 
+  for (int spin = 0; spin < barrierSpin; spin++) {
+    if (atomic_load_explicit(&rpt->sense, memory_order_acquire) == mySense) {
+      return 0;
+    }
+  }
+  pthread_mutex_lock(&(rpt->lock));
+  while (atomic_load_explicit(&rpt->sense, memory_order_acquire) != mySense) {
+    pthread_cond_wait(&(rpt->cond), &(rpt->lock));
+  }
+  pthread_mutex_unlock(&(rpt->lock));
   return 0;
 }
 
+/*
+ * Move the transfers of every worker log into the log of report r and
+ * empty the worker logs for the next report period.  Only called while
+ * every worker waits in Report_DoReport.  Returns -1 if out of memory.
+ */
+static int
+MergeWorkerLogs(Report *rpt, int r)
+{
+  int total = 0;
+  for (int w = 0; w < rpt->numWorkerLogs; w++) {
+    total += rpt->workerLogs[w].numLogEntries;
+  }
+
+  struct TransferLog *merged = malloc((total > 0 ? total : 1) * sizeof(struct TransferLog));
+  if (merged == NULL) {
+    return -1;
+  }
+
+  int ent = 0;
+  for (int w = 0; w < rpt->numWorkerLogs; w++) {
+    WorkerReport *log = &rpt->workerLogs[w];
+    memcpy(&merged[ent], log->transferLog,
+           log->numLogEntries * sizeof(struct TransferLog));
+    ent += log->numLogEntries;
+    log->numLogEntries = 0;
+  }
+
+  rpt->dailyData[r].transferLog = merged;
+  rpt->dailyData[r].numLogEntries = total;
+  return 0;
+}
+
+/*
+ * End of the day, run by the last worker to finish it: merge the worker
+ * logs into the report.
+ */
+static int
+CloseDay(Bank *bank)
+{
+  Report *rpt = bank->report;
+  rpt->dayError = MergeWorkerLogs(rpt, rpt->numReports);
+  return 0;
+}
+
+/*
+ * Run by the last worker to add up its slice of the branches: store the
+ * sum of all the slices as the bank balance of the report.
+ */
+static int
+StoreBalance(Bank *bank)
+{
+  Report *rpt = bank->report;
+  AccountAmount balance = 0;
+  for (int w = 0; w < numWorkers; w++) {
+    balance += rpt->workerLogs[w].partialBalance;
+  }
+  rpt->dailyData[rpt->numReports].balance = balance; Y;
+  int oldNumReports = rpt->numReports; Y;
+  rpt->numReports = oldNumReports + 1; Y;
+  return rpt->dayError;
+}
+
 /*
  * Perform the nightly report. Is called by every worker for each report period. workerNum is
  * the worker making the call.  Returns -1 on error, 0 otherwise.
+ *
+ * Once every worker has finished the day, no balance changes any more, so
+ * each worker adds up the balances of its own slice of the branches; the
+ * last one to finish its slice adds up the slices.
  */
 int
 Report_DoReport(Bank *bank, int workerNum)
@@ -126,26 +289,23 @@ Report_DoReport(Bank *bank, int workerNum)
       return -1;
   }
 
-  int err = 0;
+  BarrierWait(bank, workerNum, CloseDay);
 
-  pthread_mutex_lock(&(rpt->lock));
-  (bank->finishedDay)++;
-  if (bank->finishedDay == numWorkers) {
-    /*
-    * Store the overall bank balance for the report.
-    */
-    err = Bank_Balance(bank, &rpt->dailyData[rpt->numReports].balance); Y;
-    int oldNumReports = rpt->numReports; Y;
-    rpt->numReports = oldNumReports + 1; Y;
-
-    bank->finishedDay = 0;
-    pthread_cond_broadcast(&(rpt->cond));
-  } else {
-    pthread_cond_wait(&(rpt->cond), &(rpt->lock));
+  int err = 0;
+  AccountAmount partial = 0;
+  BranchID first = (BranchID) bank->numberBranches * workerNum / numWorkers;
+  BranchID last = (BranchID) bank->numberBranches * (workerNum + 1) / numWorkers;
+  for (BranchID b = first; b < last; b++) {
+    AccountAmount branchBalance = 0;
+    if (Branch_Balance(bank, b, &branchBalance) < 0) {
+      err = -1;
+    }
+    partial += branchBalance;
   }
-  pthread_mutex_unlock(&(rpt->lock));
+  rpt->workerLogs[workerNum].partialBalance = partial; Y;
 
-  return err;
+  int storeErr = BarrierWait(bank, workerNum, StoreBalance);
+  return (storeErr < 0) ? storeErr : err;
 }
 
 
@@ -199,28 +359,25 @@ Report_Compare(Bank *bank1, Bank *bank2)
               rpt2->dailyData[r].numLogEntries);
       return -1;
     }
-    if (!rpt1->dailyData[r].hasOverflowed) {
-      int i, n;
-      // If the transfer log hasn't overflowed we can compare the log. We should get the
-      // same log entries but possibly in a different order. To account for order we sort
-      // the logs.
-
-      n = rpt1->dailyData[r].numLogEntries;
-      qsort(rpt1->dailyData[r].transferLog, n, sizeof(struct TransferLog),
-            TransferLogSortFunc);
-
-      assert(n == rpt2->dailyData[r].numLogEntries);
-      qsort(rpt2->dailyData[r].transferLog, n, sizeof(struct TransferLog),
-            TransferLogSortFunc);
-
-      for (i = 0; i < n; i++) {
-        if ((rpt1->dailyData[r].transferLog[i].accountNum !=
-             rpt2->dailyData[r].transferLog[i].accountNum) ||
-            (rpt1->dailyData[r].transferLog[i].transferSize !=
-             rpt2->dailyData[r].transferLog[i].transferSize)) {
-          fprintf(stderr, "Report transferLog %d difference at %d\n", r, i);
-          err = -1;
-        }
+    int i, n;
+    // We should get the same log entries but possibly in a different order. To account
+    // for order we sort the logs.
+
+    n = rpt1->dailyData[r].numLogEntries;
+    qsort(rpt1->dailyData[r].transferLog, n, sizeof(struct TransferLog),
+          TransferLogSortFunc);
+
+    assert(n == rpt2->dailyData[r].numLogEntries);
+    qsort(rpt2->dailyData[r].transferLog, n, sizeof(struct TransferLog),
+          TransferLogSortFunc);
+
+    for (i = 0; i < n; i++) {
+      if ((rpt1->dailyData[r].transferLog[i].accountNum !=
+           rpt2->dailyData[r].transferLog[i].accountNum) ||
+          (rpt1->dailyData[r].transferLog[i].transferSize !=
+           rpt2->dailyData[r].transferLog[i].transferSize)) {
+        fprintf(stderr, "Report transferLog %d difference at %d\n", r, i);
+        err = -1;
       }
     }
   }
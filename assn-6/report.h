@@ -8,6 +8,7 @@ int Report_Init(struct Bank *bank, AccountAmount reportAmount,
                 int maxNumWorkers);
 
 int Report_DoReport(struct Bank *bank, int workerNum);
+void Report_SetBarrierSpin(int spins);
 int Report_Transfer(struct Bank *bank, int workerNum, AccountNumber accountNum,
                     AccountAmount amount);
 
@@ -2,7 +2,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include "teller.h"
 #include "account.h"
@@ -10,6 +12,16 @@
 #include "error.h"
 #include "debug.h"
 
+/*
+ * Transactions the STM engine committed and aborted in this worker.  A
+ * transaction that ends in insufficient funds counts as committed: it
+ * read a consistent snapshot and so had its answer.
+ */
+static _Thread_local struct {
+  uint64_t commits;
+  uint64_t aborts;
+} stmStats;
+
 /*
  * deposit money into an account
  */
@@ -21,19 +33,29 @@ Teller_DoDeposit(Bank *bank, AccountNumber accountNum, AccountAmount amount)
   DPRINTF('t', ("Teller_DoDeposit(account 0x%"PRIx64" amount %"PRId64")\n",
                 accountNum, amount));
 
+  if (bank->engine == BANK_ENGINE_STM) {
+    TellerLeg leg = { accountNum, amount, 0 };
+    return Teller_DoMulti(bank, &leg, 1);
+  }
+
   Account *account = Account_LookupByNumber(bank, accountNum);
 
   if (account == NULL) {
     return ERROR_ACCOUNT_NOT_FOUND;
   }
 
-  BranchID branchID = AccountNum_GetBranchID(accountNum);
+  if (bank->engine == BANK_ENGINE_ATOMIC) {
+    Account_Adjust(bank, account, amount, 1);
+    return ERROR_SUCCESS;
+  }
 
-  pthread_mutex_lock(&(account->lock));
-  pthread_mutex_lock(&(bank->branches[branchID].lock));
+  /*
+   * The branch balance change goes into this worker's own delta (see
+   * Branch_UpdateBalance), so only the account needs locking.
+   */
+  Lock_Acquire(&(account->lock));
   Account_Adjust(bank, account, amount, 1);
-  pthread_mutex_unlock(&(account->lock));
-  pthread_mutex_unlock(&(bank->branches[branchID].lock));
+  Lock_Release(&(account->lock));
 
   return ERROR_SUCCESS;
 }
@@ -49,32 +71,41 @@ Teller_DoWithdraw(Bank *bank, AccountNumber accountNum, AccountAmount amount)
   DPRINTF('t', ("Teller_DoWithdraw(account 0x%"PRIx64" amount %"PRId64")\n",
                 accountNum, amount));
 
+  if (bank->engine == BANK_ENGINE_STM) {
+    TellerLeg leg = { accountNum, -amount, 1 };
+    return Teller_DoMulti(bank, &leg, 1);
+  }
+
   Account *account = Account_LookupByNumber(bank, accountNum);
 
   if (account == NULL) {
     return ERROR_ACCOUNT_NOT_FOUND;
   }
 
-  BranchID branchID = AccountNum_GetBranchID(accountNum);
+  if (bank->engine == BANK_ENGINE_ATOMIC) {
+    if (Account_AtomicWithdraw(bank, account, amount, 1) < 0) {
+      return ERROR_INSUFFICIENT_FUNDS;
+    }
+    return ERROR_SUCCESS;
+  }
 
-  pthread_mutex_lock(&(account->lock));
-  pthread_mutex_lock(&(bank->branches[branchID].lock));
+  Lock_Acquire(&(account->lock));
   
   if (amount > Account_Balance(account)) {
-    pthread_mutex_unlock(&(account->lock));
-    pthread_mutex_unlock(&(bank->branches[branchID].lock));
+    Lock_Release(&(account->lock));
     return ERROR_INSUFFICIENT_FUNDS;
   }
 
   Account_Adjust(bank, account, -amount, 1);
-  pthread_mutex_unlock(&(account->lock));
-  pthread_mutex_unlock(&(bank->branches[branchID].lock));
+  Lock_Release(&(account->lock));
 
   return ERROR_SUCCESS;
 }
 
 /*
- * do a tranfer from one account to another account
+ * do a tranfer from one account to another account, as a Teller_DoMulti
+ * of two legs.  A transfer from an account to itself changes nothing and
+ * always succeeds.
  */
 int
 Teller_DoTransfer(Bank *bank, AccountNumber srcAccountNum,
@@ -87,63 +118,493 @@ Teller_DoTransfer(Bank *bank, AccountNumber srcAccountNum,
                 ", amount %"PRId64")\n",
                 srcAccountNum, dstAccountNum, amount));
 
-  if (srcAccountNum == dstAccountNum)
+  if (srcAccountNum == dstAccountNum) {
     return ERROR_SUCCESS;
+  }
 
-  Account *srcAccount = Account_LookupByNumber(bank, srcAccountNum);
-  if (srcAccount == NULL) {
-    return ERROR_ACCOUNT_NOT_FOUND;
+  TellerLeg legs[2] = {
+    { srcAccountNum, -amount, 1 },
+    { dstAccountNum, amount, 0 },
+  };
+  return Teller_DoMulti(bank, legs, 2);
+}
+
+/*
+ * net change of one branch balance over a batch
+ */
+typedef struct BranchNet {
+  BranchID branchID;
+  AccountAmount change;
+} BranchNet;
+
+/*
+ * add change to the net of the account's branch.  The nets are kept
+ * sorted by branch so that finding one is a binary search.
+ */
+static void
+AddBranchNet(BranchNet *nets, int *numNets, Account *account,
+             AccountAmount change)
+{
+  BranchID branchID = AccountNum_GetBranchID(account->accountNumber);
+  int lo = 0, hi = *numNets;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (nets[mid].branchID < branchID) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < *numNets && nets[lo].branchID == branchID) {
+    nets[lo].change += change;
+    return;
   }
+  memmove(&nets[lo + 1], &nets[lo], (*numNets - lo) * sizeof(nets[0]));
+  nets[lo].branchID = branchID;
+  nets[lo].change = change;
+  (*numNets)++;
+}
 
-  Account *dstAccount = Account_LookupByNumber(bank, dstAccountNum);
-  if (dstAccount == NULL) {
-    return ERROR_ACCOUNT_NOT_FOUND;
+/*
+ * add the account to the set of accounts to lock, kept sorted by account
+ * number (the order Teller_DoMulti locks in too) and without duplicates.
+ */
+static void
+AddLockedAccount(Account **locked, int *numLocked, Account *account)
+{
+  int lo = 0, hi = *numLocked;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (locked[mid]->accountNumber < account->accountNumber) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < *numLocked && locked[lo] == account) {
+    return;
+  }
+  memmove(&locked[lo + 1], &locked[lo], (*numLocked - lo) * sizeof(locked[0]));
+  locked[lo] = account;
+  (*numLocked)++;
+}
+
+/*
+ * take amount out of the account if its balance covers it, leaving the
+ * branch balance alone.  The mutex engine holds the account lock already.
+ */
+static int
+BatchWithdraw(Bank *bank, Account *account, AccountAmount amount)
+{
+  if (bank->engine == BANK_ENGINE_ATOMIC) {
+    return Account_AtomicWithdraw(bank, account, amount, 0);
+  }
+  if (amount > Account_Balance(account)) {
+    return -1;
   }
+  Account_Adjust(bank, account, -amount, 0);
+  return 0;
+}
+
+/*
+ * do a batch of deposits, withdrawals and transfers, in order, with the
+ * same results as doing them one by one.  The mutex engine locks every
+ * account the batch touches once, in account number order (the order
+ * Teller_DoMulti locks in too), rather than once per operation.  The
+ * changes to the branch balances are added up per branch and applied once
+ * at the end, as one update of this worker (see Branch_BeginUpdate).
+ */
+int
+Teller_DoBatch(Bank *bank, TellerOp *ops, int numOps)
+{
+  assert(numOps <= TELLER_MAX_BATCH);
 
   /*
-   * If we are doing a transfer within the branch, we tell the Account module to
-   * not bother updating the branch balance since the net change for the
-   * branch is 0.
+   * The STM engine runs every operation as a transaction of its own.
    */
-  int updateBranch = !Account_IsSameBranch(srcAccountNum, dstAccountNum);
+  if (bank->engine == BANK_ENGINE_STM) {
+    for (int i = 0; i < numOps; i++) {
+      TellerOp *op = &ops[i];
+      switch (op->type) {
+      case TELLER_DEPOSIT:
+        op->result = Teller_DoDeposit(bank, op->dstAccountNum, op->amount);
+        break;
+      case TELLER_WITHDRAW:
+        op->result = Teller_DoWithdraw(bank, op->srcAccountNum, op->amount);
+        break;
+      case TELLER_TRANSFER:
+        op->result = Teller_DoTransfer(bank, op->srcAccountNum,
+                                       op->dstAccountNum, op->amount);
+        break;
+      }
+    }
+    return ERROR_SUCCESS;
+  }
 
-  BranchID srcBranchID = AccountNum_GetBranchID(srcAccountNum);
-  BranchID dstBranchID = AccountNum_GetBranchID(dstAccountNum);
-  
-  if (srcAccount->accountNumber < dstAccount->accountNumber) {
-    pthread_mutex_lock(&(srcAccount->lock));
-    pthread_mutex_lock(&(dstAccount->lock));
-    if (updateBranch) {
-      pthread_mutex_lock(&(bank->branches[srcBranchID].lock));
-      pthread_mutex_lock(&(bank->branches[dstBranchID].lock));
+  Account *src[TELLER_MAX_BATCH], *dst[TELLER_MAX_BATCH];
+
+  for (int i = 0; i < numOps; i++) {
+    TellerOp *op = &ops[i];
+    assert(op->amount >= 0);
+    src[i] = dst[i] = NULL;
+    op->result = ERROR_SUCCESS;
+    if (op->type == TELLER_TRANSFER && op->srcAccountNum == op->dstAccountNum) {
+      continue;
     }
-  } else {
-    pthread_mutex_lock((&dstAccount->lock));
-    pthread_mutex_lock((&srcAccount->lock));
-    if (updateBranch) {
-      pthread_mutex_lock(&(bank->branches[dstBranchID].lock));
-      pthread_mutex_lock(&(bank->branches[srcBranchID].lock));
+    Account *srcAccount = NULL, *dstAccount = NULL;
+    if (op->type != TELLER_DEPOSIT) {
+      srcAccount = Account_LookupByNumber(bank, op->srcAccountNum);
+    }
+    if (op->type != TELLER_WITHDRAW) {
+      dstAccount = Account_LookupByNumber(bank, op->dstAccountNum);
+    }
+    if ((op->type != TELLER_DEPOSIT && srcAccount == NULL) ||
+        (op->type != TELLER_WITHDRAW && dstAccount == NULL)) {
+      op->result = ERROR_ACCOUNT_NOT_FOUND;
+      continue;
     }
+    src[i] = srcAccount;
+    dst[i] = dstAccount;
   }
-  
-  if (amount > Account_Balance(srcAccount)) {
-    pthread_mutex_unlock(&(dstAccount->lock));
-    pthread_mutex_unlock(&(srcAccount->lock));
-    if (updateBranch) {
-      pthread_mutex_unlock(&(bank->branches[srcBranchID].lock));
-      pthread_mutex_unlock(&(bank->branches[dstBranchID].lock));
+
+  Account *locked[2 * TELLER_MAX_BATCH];
+  int numLocked = 0;
+
+  if (bank->engine == BANK_ENGINE_MUTEX) {
+    for (int i = 0; i < numOps; i++) {
+      if (src[i] != NULL) {
+        AddLockedAccount(locked, &numLocked, src[i]);
+      }
+      if (dst[i] != NULL) {
+        AddLockedAccount(locked, &numLocked, dst[i]);
+      }
     }
-    return ERROR_INSUFFICIENT_FUNDS;
+    for (int l = 0; l < numLocked; l++) {
+      Lock_Acquire(&(locked[l]->lock));
+    }
+  }
+
+  BranchNet nets[2 * TELLER_MAX_BATCH];
+  int numNets = 0;
+
+  for (int i = 0; i < numOps; i++) {
+    if (src[i] == NULL && dst[i] == NULL) {
+      continue;
+    }
+    AccountAmount amount = ops[i].amount;
+    if (src[i] != NULL) {
+      if (BatchWithdraw(bank, src[i], amount) < 0) {
+        ops[i].result = ERROR_INSUFFICIENT_FUNDS;
+        continue;
+      }
+      AddBranchNet(nets, &numNets, src[i], -amount);
+    }
+    if (dst[i] != NULL) {
+      Account_Adjust(bank, dst[i], amount, 0);
+      AddBranchNet(nets, &numNets, dst[i], amount);
+    }
+  }
+
+  if (bank->engine == BANK_ENGINE_MUTEX) {
+    for (int l = numLocked - 1; l >= 0; l--) {
+      Lock_Release(&(locked[l]->lock));
+    }
+  }
+
+  Branch_BeginUpdate(bank);
+  for (int n = 0; n < numNets; n++) {
+    if (nets[n].change != 0) {
+      Branch_UpdateBalance(bank, nets[n].branchID, nets[n].change);
+    }
+  }
+  Branch_EndUpdate(bank);
+
+  return ERROR_SUCCESS;
+}
+
+/*
+ * net change of one account over the legs of a Teller_DoMulti, and whether
+ * any of them was a debit, in which case the account must not be left
+ * overdrawn (see TellerLeg).
+ */
+typedef struct AccountNet {
+  Account *account;
+  AccountAmount change;
+  int debit;
+} AccountNet;
+
+/*
+ * does applying the net need the account: it changes, or it is a debit and
+ * so has its balance checked
+ */
+static inline int
+NetTouchesAccount(const AccountNet *net)
+{
+  return net->change != 0 || net->debit;
+}
+
+/*
+ * would the net leave a debited account overdrawn, given its balance
+ */
+static inline int
+NetIsShort(const AccountNet *net, AccountAmount balance)
+{
+  return net->debit && balance + net->change < 0;
+}
+
+/*
+ * add change to the net of the account.  The nets are kept sorted by
+ * account number, the order the mutex engine locks in; a Teller_DoMulti
+ * has few legs, so the account goes in with a plain insertion from the end.
+ */
+static void
+AddAccountNet(AccountNet *nets, int *numNets, Account *account,
+              AccountAmount change, int debit)
+{
+  int n = *numNets;
+  while (n > 0 && nets[n - 1].account->accountNumber > account->accountNumber) {
+    n--;
+  }
+  if (n > 0 && nets[n - 1].account == account) {
+    nets[n - 1].change += change;
+    nets[n - 1].debit |= debit;
+    return;
+  }
+  for (int m = *numNets; m > n; m--) {
+    nets[m] = nets[m - 1];
+  }
+  nets[n].account = account;
+  nets[n].change = change;
+  nets[n].debit = debit;
+  (*numNets)++;
+}
+
+/*
+ * apply the account nets with the mutex engine: lock the accounts that
+ * change or are debited in account number order, and apply nothing unless
+ * every debited balance stays covered.
+ */
+static int
+LockedApplyNets(Bank *bank, AccountNet *nets, int numNets)
+{
+  for (int n = 0; n < numNets; n++) {
+    if (NetTouchesAccount(&nets[n])) {
+      Lock_Acquire(&(nets[n].account->lock));
+    }
+  }
+
+  int err = ERROR_SUCCESS;
+  for (int n = 0; n < numNets; n++) {
+    if (NetIsShort(&nets[n], Account_Balance(nets[n].account))) {
+      err = ERROR_INSUFFICIENT_FUNDS;
+      break;
+    }
+  }
+  if (err == ERROR_SUCCESS) {
+    for (int n = 0; n < numNets; n++) {
+      if (nets[n].change != 0) {
+        Account_Adjust(bank, nets[n].account, nets[n].change, 0);
+      }
+    }
+  }
+
+  for (int n = numNets - 1; n >= 0; n--) {
+    if (NetTouchesAccount(&nets[n])) {
+      Lock_Release(&(nets[n].account->lock));
+    }
+  }
+  return err;
+}
+
+/*
+ * apply the account nets with the atomic engine: apply the debited nets one
+ * by one with a compare-and-swap that checks the funds (a withdrawal of
+ * minus the net), putting back the ones already applied if a later one
+ * fails, and only then add the others.  With one debited account, as in a
+ * transfer or a payroll, nothing is ever put back.  With several, other
+ * tellers can see the debits taken before one failed, and may fail for
+ * lack of funds themselves before they are put back: the operation is all
+ * or nothing in its result, but not as other tellers see it.
+ */
+static int
+AtomicApplyNets(Bank *bank, AccountNet *nets, int numNets)
+{
+  for (int n = 0; n < numNets; n++) {
+    if (!nets[n].debit) {
+      continue;
+    }
+    if (Account_AtomicWithdraw(bank, nets[n].account, -nets[n].change, 0) < 0) {
+      while (--n >= 0) {
+        if (nets[n].debit && nets[n].change != 0) {
+          Account_Adjust(bank, nets[n].account, -nets[n].change, 0);
+        }
+      }
+      return ERROR_INSUFFICIENT_FUNDS;
+    }
+  }
+  for (int n = 0; n < numNets; n++) {
+    if (!nets[n].debit && nets[n].change != 0) {
+      Account_Adjust(bank, nets[n].account, nets[n].change, 0);
+    }
+  }
+  return ERROR_SUCCESS;
+}
+
+/*
+ * apply the account nets with the STM engine, as a transaction: read the
+ * accounts that change or are debited along with their versions and check
+ * the funds on what was read, then commit by taking those accounts, in
+ * account number order, at the versions read and writing the new balances.
+ * A debited account that doesn't change is taken too, so that its balance
+ * is still the one checked, and given back at the same version.  If another
+ * commit got to one of the accounts first, the transaction aborts and
+ * starts over.
+ */
+static int
+StmApplyNets(Bank *bank, AccountNet *nets, int numNets)
+{
+  uint64_t versions[TELLER_MAX_LEGS];
+
+  for (;;) {
+    int covered = 1;
+    for (int n = 0; n < numNets; n++) {
+      if (NetTouchesAccount(&nets[n])) {
+        AccountAmount balance = Account_StmRead(nets[n].account, &versions[n]);
+        if (NetIsShort(&nets[n], balance)) {
+          covered = 0;
+        }
+      }
+    }
+
+    if (!covered) {
+      /*
+       * Short of funds is the answer only if every balance is still the one
+       * read, so that the reads were one snapshot.
+       */
+      int n = 0;
+      while (n < numNets && (!NetTouchesAccount(&nets[n]) ||
+                             Account_StmValidate(nets[n].account,
+                                                 versions[n]) == 0)) {
+        n++;
+      }
+      if (n == numNets) {
+        stmStats.commits++;
+        return ERROR_INSUFFICIENT_FUNDS;
+      }
+      stmStats.aborts++;
+      continue;
+    }
+
+    int taken = 0;
+    while (taken < numNets && (!NetTouchesAccount(&nets[taken]) ||
+                               Account_StmLock(nets[taken].account,
+                                               versions[taken]) == 0)) {
+      taken++;
+    }
+    if (taken < numNets) {
+      while (--taken >= 0) {
+        if (NetTouchesAccount(&nets[taken])) {
+          Account_StmUnlock(nets[taken].account, versions[taken]);
+        }
+      }
+      stmStats.aborts++;
+      continue;
+    }
+
+    for (int n = 0; n < numNets; n++) {
+      if (nets[n].change != 0) {
+        Account_Adjust(bank, nets[n].account, nets[n].change, 0);
+        Account_StmUnlock(nets[n].account, versions[n] + 2);
+      } else if (nets[n].debit) {
+        Account_StmUnlock(nets[n].account, versions[n]);
+      }
+    }
+    stmStats.commits++;
+    return ERROR_SUCCESS;
   }
+}
 
-  Account_Adjust(bank, srcAccount, -amount, updateBranch);
-  Account_Adjust(bank, dstAccount, amount, updateBranch);
+/*
+ * get the number of transactions the STM engine committed and aborted in
+ * the calling worker.
+ */
+void
+Teller_StmStats(uint64_t *commits, uint64_t *aborts)
+{
+  *commits = stmStats.commits;
+  *aborts = stmStats.aborts;
+}
 
-  pthread_mutex_unlock(&(dstAccount->lock));
-  pthread_mutex_unlock(&(srcAccount->lock));
-  if (updateBranch) {
-    pthread_mutex_unlock(&(bank->branches[srcBranchID].lock));
-    pthread_mutex_unlock(&(bank->branches[dstBranchID].lock));
+/*
+ * apply a list of legs, each adding delta (negative to take money out) to
+ * one account, all or nothing: if any account with a debit leg would be
+ * left overdrawn, none of them change.  The atomic engine only keeps that
+ * from other tellers' view with a single debited account (see
+ * AtomicApplyNets).  Legs on the same account are added up first, so the mutex
+ * engine locks every account once, in account number order, and needs no
+ * lock ladder however many legs there are.  The branch balances change by
+ * their net over all the legs, as one update of this worker (see
+ * Branch_BeginUpdate) when more than one branch changes.
+ */
+int
+Teller_DoMulti(Bank *bank, const TellerLeg *legs, int numLegs)
+{
+  assert(numLegs <= TELLER_MAX_LEGS);
+
+  AccountNet accountNets[TELLER_MAX_LEGS];
+  int numAccounts = 0;
+
+  for (int i = 0; i < numLegs; i++) {
+    Account *account = Account_LookupByNumber(bank, legs[i].accountNum);
+    if (account == NULL) {
+      return ERROR_ACCOUNT_NOT_FOUND;
+    }
+    AddAccountNet(accountNets, &numAccounts, account, legs[i].delta,
+                  legs[i].debit || legs[i].delta < 0);
+  }
+
+  int err;
+  if (bank->engine == BANK_ENGINE_ATOMIC) {
+    err = AtomicApplyNets(bank, accountNets, numAccounts);
+  } else if (bank->engine == BANK_ENGINE_STM) {
+    err = StmApplyNets(bank, accountNets, numAccounts);
+  } else {
+    err = LockedApplyNets(bank, accountNets, numAccounts);
+  }
+  if (err != ERROR_SUCCESS) {
+    return err;
+  }
+
+  /*
+   * The branch is the top half of an account number, so the nets sorted by
+   * account come grouped by branch already.
+   */
+  BranchNet nets[TELLER_MAX_LEGS];
+  int numNets = 0, numChanged = 0;
+  for (int n = 0; n < numAccounts; n++) {
+    BranchID branchID =
+      AccountNum_GetBranchID(accountNets[n].account->accountNumber);
+    if (numNets == 0 || nets[numNets - 1].branchID != branchID) {
+      nets[numNets].branchID = branchID;
+      nets[numNets].change = 0;
+      numNets++;
+    }
+    nets[numNets - 1].change += accountNets[n].change;
+  }
+  for (int n = 0; n < numNets; n++) {
+    numChanged += (nets[n].change != 0);
+  }
+
+  if (numChanged > 1) {
+    Branch_BeginUpdate(bank);
+  }
+  for (int n = 0; n < numNets; n++) {
+    if (nets[n].change != 0) {
+      Branch_UpdateBalance(bank, nets[n].branchID, nets[n].change);
+    }
+  }
+  if (numChanged > 1) {
+    Branch_EndUpdate(bank);
   }
 
   return ERROR_SUCCESS;
@@ -17,5 +17,55 @@ int Teller_DoTransfer(Bank *bank, AccountNumber srcAccountNum,
                       AccountAmount amount);
 
 
+/*
+ * The largest number of operations Teller_DoBatch takes at once.
+ */
+#define TELLER_MAX_BATCH 256
+
+typedef enum {
+  TELLER_DEPOSIT,   /* into dstAccountNum */
+  TELLER_WITHDRAW,  /* from srcAccountNum */
+  TELLER_TRANSFER,  /* from srcAccountNum to dstAccountNum */
+} TellerOpType;
+
+/*
+ * One operation of a batch.  Teller_DoBatch fills in result with what the
+ * matching Teller_Do call would have returned.
+ */
+typedef struct TellerOp {
+  TellerOpType type;
+  AccountNumber srcAccountNum;
+  AccountNumber dstAccountNum;
+  AccountAmount amount;
+  int result;
+} TellerOp;
+
+int Teller_DoBatch(Bank *bank, TellerOp *ops, int numOps);
+
+
+/*
+ * The largest number of legs Teller_DoMulti takes at once.
+ */
+#define TELLER_MAX_LEGS 256
+
+/*
+ * One leg of a Teller_DoMulti: delta is added to the account, so a
+ * negative delta takes money out.  A transfer is two legs, a payroll one
+ * negative leg and a positive leg per payee.  A leg with a negative delta
+ * is a debit: its account must not be left overdrawn.  debit makes a leg
+ * with a delta of 0 a debit too, so taking 0 out of an overdrawn account
+ * fails just as a withdrawal of 0 from one does.
+ */
+typedef struct TellerLeg {
+  AccountNumber accountNum;
+  AccountAmount delta;
+  int debit;
+} TellerLeg;
+
+int Teller_DoMulti(Bank *bank, const TellerLeg *legs, int numLegs);
+
+void Teller_StmStats(uint64_t *commits, uint64_t *aborts);
+
+
 
 #endif /* _Teller_H */